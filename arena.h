@@ -0,0 +1,128 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <vector>
+
+/* Bump allocator: memory is given back all at once by Reset and kept for the next round */
+class Arena {
+public:
+    explicit Arena(size_t chunk_size = 1 << 20) : chunk_size_(chunk_size) {}
+
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    void* Allocate(size_t size, size_t alignment) {
+        while (current_ < chunks_.size()) {
+            auto& chunk = chunks_[current_];
+            size_t begin = (offset_ + alignment - 1) / alignment * alignment;
+            if (begin + size <= chunk.size) {
+                offset_ = begin + size;
+                used_ += size;
+                return chunk.data.get() + begin;
+            }
+            ++current_;
+            offset_ = 0;
+        }
+        chunks_.push_back({std::make_unique<uint8_t[]>(std::max(chunk_size_, size + alignment)),
+                           std::max(chunk_size_, size + alignment)});
+        ++heap_allocations_;
+        return Allocate(size, alignment);
+    }
+
+    /* Everything allocated before is invalidated. Several chunks are merged into one,
+     * so the same workload fits without new allocations next time. */
+    void Reset() {
+        if (chunks_.size() > 1) {
+            size_t size = 0;
+            for (auto&& chunk : chunks_) {
+                size += chunk.size;
+            }
+            chunks_.clear();
+            chunks_.push_back({std::make_unique<uint8_t[]>(size), size});
+            ++heap_allocations_;
+        }
+        current_ = 0;
+        offset_ = 0;
+        used_ = 0;
+    }
+
+    size_t Used() const {
+        return used_;
+    }
+
+    /* Chunks allocated over the lifetime of the arena */
+    size_t HeapAllocations() const {
+        return heap_allocations_;
+    }
+
+    size_t Capacity() const {
+        size_t size = 0;
+        for (auto&& chunk : chunks_) {
+            size += chunk.size;
+        }
+        return size;
+    }
+
+private:
+    struct Chunk {
+        std::unique_ptr<uint8_t[]> data;
+        size_t size;
+    };
+
+    size_t chunk_size_;
+    std::vector<Chunk> chunks_;
+    size_t current_ = 0;
+    size_t offset_ = 0;
+    size_t used_ = 0;
+    size_t heap_allocations_ = 0;
+};
+
+/* Standard allocator over an Arena. Without an arena it falls back to the heap */
+template <typename T>
+class ArenaAllocator {
+public:
+    using value_type = T;
+
+    ArenaAllocator() = default;
+    ArenaAllocator(Arena* arena) : arena_(arena) {}
+
+    template <typename U>
+    ArenaAllocator(const ArenaAllocator<U>& other) : arena_(other.GetArena()) {}
+
+    T* allocate(size_t n) {
+        if (!arena_) {
+            return static_cast<T*>(::operator new(n * sizeof(T)));
+        }
+        return static_cast<T*>(arena_->Allocate(n * sizeof(T), alignof(T)));
+    }
+
+    void deallocate(T* ptr, size_t) {
+        if (!arena_) {
+            ::operator delete(ptr);
+        }
+    }
+
+    Arena* GetArena() const {
+        return arena_;
+    }
+
+    template <typename U>
+    friend bool operator==(const ArenaAllocator& lhs, const ArenaAllocator<U>& rhs) {
+        return lhs.arena_ == rhs.GetArena();
+    }
+
+    template <typename U>
+    friend bool operator!=(const ArenaAllocator& lhs, const ArenaAllocator<U>& rhs) {
+        return !(lhs == rhs);
+    }
+
+private:
+    Arena* arena_ = nullptr;
+};
+
+template <typename T>
+using ArenaVector = std::vector<T, ArenaAllocator<T>>;
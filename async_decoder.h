@@ -0,0 +1,138 @@
+#pragma once
+
+#include "decoder.h"
+
+#if !defined(__cpp_impl_coroutine) || !__has_include(<coroutine>)
+#error "async_decoder.h needs C++20 coroutines"
+#endif
+
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <utility>
+
+/* Result of a decode coroutine. Nothing runs until it is awaited or started. */
+class DecodeTask {
+public:
+    struct promise_type {
+        struct FinalAwaiter {
+            bool await_ready() const noexcept {
+                return false;
+            }
+
+            std::coroutine_handle<> await_suspend(
+                    std::coroutine_handle<promise_type> handle) const noexcept {
+                return handle.promise().continuation;
+            }
+
+            void await_resume() const noexcept {}
+        };
+
+        DecodeTask get_return_object() {
+            return DecodeTask(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+
+        std::suspend_always initial_suspend() const noexcept {
+            return {};
+        }
+
+        FinalAwaiter final_suspend() const noexcept {
+            return {};
+        }
+
+        void return_value(DecodeResult value) {
+            result.emplace(value);
+        }
+
+        void unhandled_exception() {
+            result.emplace(DecodeError::kBadFile);
+        }
+
+        std::optional<DecodeResult> result;
+        std::coroutine_handle<> continuation = std::noop_coroutine();
+    };
+
+    DecodeTask(DecodeTask&& other) noexcept : handle_(std::exchange(other.handle_, {})) {}
+    DecodeTask& operator=(DecodeTask&&) = delete;
+
+    ~DecodeTask() {
+        if (handle_) {
+            handle_.destroy();
+        }
+    }
+
+    bool await_ready() const noexcept {
+        return handle_.done();
+    }
+
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+        handle_.promise().continuation = awaiting;
+        return handle_;
+    }
+
+    DecodeResult await_resume() const {
+        return Result();
+    }
+
+    /* For callers that aren't coroutines: runs until the first suspension, whoever completes
+     * the awaited reads and yields resumes it from there */
+    void Start() {
+        handle_.resume();
+    }
+
+    bool Done() const {
+        return handle_.done();
+    }
+
+    DecodeResult Result() const {
+        return *handle_.promise().result;
+    }
+
+private:
+    explicit DecodeTask(std::coroutine_handle<promise_type> handle) : handle_(handle) {}
+
+    std::coroutine_handle<promise_type> handle_;
+};
+
+/* co_await DecodeAsync(source, &context) decodes the file as its bytes come in. Source provides
+ *   co_await source.Read(uint8_t* buffer, size_t size) -> size_t, 0 at the end of the file
+ *   co_await source.Yield(), suspends until the event loop gets round to the decode again
+ * and is awaited for input whenever the decoder runs out of it, and every rows_per_yield MCU rows
+ * so that a huge image doesn't hold up the thread. The image is context's, as with TryDecode. */
+template <typename Source>
+DecodeTask DecodeAsync(Source& source, DecoderContext* context, size_t rows_per_yield = 16,
+                       DecodeStats* stats = nullptr) {
+    if (stats) {
+        *stats = DecodeStats();
+    }
+    auto error = DecodeError::kNone;
+    try {
+        Decoder decoder(context, stats);
+        auto buffer = reinterpret_cast<uint8_t*>(context->file_buffer.data());
+        while (true) {
+            auto progress = decoder.Resume(rows_per_yield);
+            if (progress == Decoder::Progress::kDone) {
+                break;
+            }
+            if (progress == Decoder::Progress::kYield) {
+                co_await source.Yield();
+                continue;
+            }
+            size_t size = co_await source.Read(buffer, context->file_buffer.size());
+            if (size) {
+                decoder.AppendInput(buffer, size);
+            } else {
+                decoder.EndInput();
+            }
+        }
+        error = decoder.Error();
+    } catch (const DecodeException& exception) {
+        error = exception.Error();
+    } catch (const std::exception&) {
+        error = DecodeError::kBadFile;
+    }
+    if (error != DecodeError::kNone) {
+        co_return error;
+    }
+    co_return context->image;
+}
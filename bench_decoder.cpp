@@ -0,0 +1,542 @@
+#include "corpus.h"
+#include "decoder.h"
+#include "libjpg_reader.h"
+#include "transcoder.h"
+
+#include <benchmark/benchmark.h>
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+namespace fs = std::filesystem;
+
+std::string tests_dir = "../tests";
+bool compare_libjpeg = false;
+
+constexpr size_t kSymbols = 1 << 20;
+constexpr size_t kRowWidth = 4096;
+
+std::string TempPath(const std::string& name) {
+    return (fs::temp_directory_path() / name).string();
+}
+
+void WriteBytes(const std::string& filename, const std::vector<uint8_t>& data) {
+    std::ofstream file(filename, std::ios::binary);
+    file.write(reinterpret_cast<const char*>(data.data()), data.size());
+    if (!file) {
+        throw std::runtime_error("Can't write " + filename);
+    }
+}
+
+struct EntropyStream {
+    std::string filename;
+    /* Without stuffed zero bytes */
+    size_t payload_bytes;
+};
+
+/* Entropy-coded data of kSymbols standard luminance AC symbols, shorter codes are more frequent */
+const EntropyStream& HuffmanStream() {
+    static const EntropyStream stream = [] {
+        auto& table = standard_huffman::kLuminanceAC;
+        HuffmanSpec spec;
+        spec.bits = table.counts;
+        spec.values.assign(table.values.begin(), table.values.begin() + table.NumberOfCodes());
+        HuffmanEncoder encoder(spec);
+
+        std::vector<uint8_t> data;
+        BitWriter writer(&data);
+        std::mt19937 random(42);
+        std::geometric_distribution<size_t> distribution(0.15);
+        for (size_t i = 0; i < kSymbols; ++i) {
+            encoder.Encode(&writer, spec.values[distribution(random) % spec.values.size()]);
+        }
+        writer.Flush();
+
+        auto filename = TempPath("bench_decoder_huffman.bin");
+        WriteBytes(filename, data);
+        auto stuffed = std::count(data.begin(), data.end(), 0xFF);
+        return EntropyStream{filename, data.size() - stuffed};
+    }();
+    return stream;
+}
+
+Block RandomBlock(std::mt19937* random, size_t nonzero, int range) {
+    Block block{};
+    std::uniform_int_distribution<int> value(-range, range);
+    for (size_t k = 0; k < nonzero; ++k) {
+        auto position = kZigzagOrder[k];
+        block[position / BLOCK_SIZE][position % BLOCK_SIZE] = value(*random);
+    }
+    return block;
+}
+
+void BM_BitReader(benchmark::State& state) {
+    auto& stream = HuffmanStream();
+    size_t bits = stream.payload_bytes * 8;
+    size_t size = state.range(0);
+    for (auto _ : state) {
+        File file(stream.filename);
+        BitReader reader(&file);
+        uint32_t checksum = 0;
+        for (size_t read = 0; read + size <= bits; read += size) {
+            checksum += reader.GetBits(size);
+        }
+        benchmark::DoNotOptimize(checksum);
+    }
+    state.SetBytesProcessed(state.iterations() * stream.payload_bytes);
+}
+BENCHMARK(BM_BitReader)->Arg(1)->Arg(4)->Arg(11);
+
+template <typename HuffmanDecoderType>
+void DecodeSymbols(benchmark::State& state, const HuffmanDecoderType& decoder) {
+    auto& stream = HuffmanStream();
+    for (auto _ : state) {
+        File file(stream.filename);
+        BitReader reader(&file);
+        uint32_t checksum = 0;
+        for (size_t i = 0; i < kSymbols; ++i) {
+            checksum += decoder.DecodeNext(&reader);
+        }
+        benchmark::DoNotOptimize(checksum);
+    }
+    state.SetItemsProcessed(state.iterations() * kSymbols);
+    state.SetBytesProcessed(state.iterations() * stream.payload_bytes);
+}
+
+void BM_HuffmanDecode(benchmark::State& state) {
+    DecodeSymbols(state, *HuffmanDecoderCache::Instance().Get(standard_huffman::kLuminanceAC));
+}
+BENCHMARK(BM_HuffmanDecode);
+
+void BM_HuffmanDecodeStatic(benchmark::State& state) {
+    DecodeSymbols(state, StaticHuffmanDecoder<standard_huffman::kLuminanceACDecoder>());
+}
+BENCHMARK(BM_HuffmanDecodeStatic);
+
+void BM_Dequant(benchmark::State& state) {
+    std::mt19937 random(1);
+    auto block = RandomBlock(&random, 64, 64);
+    auto table = RandomBlock(&random, 64, 255);
+    for (auto _ : state) {
+        auto dequantized = block;
+        Dequantize(dequantized, table);
+        benchmark::DoNotOptimize(dequantized);
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_Dequant);
+
+/* Kernels of the CpuLevel given as the benchmark's last argument, null if the CPU lacks it */
+const Kernels* BenchmarkKernels(benchmark::State& state, size_t argument) {
+    auto level = static_cast<CpuLevel>(state.range(argument));
+    state.SetLabel(CpuLevelName(level));
+    if (KernelsFor(level).level != level) {
+        state.SkipWithError("Not supported by this CPU");
+        return nullptr;
+    }
+    return &KernelsFor(level);
+}
+
+void KernelLevels(benchmark::internal::Benchmark* benchmark, std::vector<int64_t> arguments) {
+    for (int level = 0; level <= static_cast<int>(CpuLevel::kAVX512); ++level) {
+        arguments.push_back(level);
+        benchmark->Args(arguments);
+        arguments.pop_back();
+    }
+}
+
+/* Arguments are the number of nonzero coefficients and the CpuLevel */
+void BM_IDCT(benchmark::State& state) {
+    auto kernels = BenchmarkKernels(state, 1);
+    if (!kernels) {
+        return;
+    }
+    std::mt19937 random(2);
+    auto block = RandomBlock(&random, state.range(0), 256);
+    std::array<uint8_t, BLOCK_SIZE * BLOCK_SIZE> samples;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(block);
+        kernels->inverse_dct(block, samples.data(), BLOCK_SIZE);
+        benchmark::DoNotOptimize(samples);
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_IDCT)->Apply([](auto* benchmark) {
+    for (int64_t nonzero : {1, 10, 64}) {
+        KernelLevels(benchmark, {nonzero});
+    }
+});
+
+/* A row of kRowWidth / 8 blocks through inverse_dct_row, arguments are the number of nonzero
+ * coefficients, the IDCTMode and the CpuLevel */
+void BM_IDCTRow(benchmark::State& state) {
+    auto kernels = BenchmarkKernels(state, 2);
+    if (!kernels) {
+        return;
+    }
+    auto mode = static_cast<IDCTMode>(state.range(1));
+    state.SetLabel(std::string(IDCTModeName(mode)) + " " + CpuLevelName(kernels->level));
+    auto inverse_dct_row = kernels->inverse_dct_row[state.range(1)];
+    std::mt19937 random(2);
+    std::vector<Block> blocks(kRowWidth / BLOCK_SIZE);
+    for (auto&& block : blocks) {
+        block = RandomBlock(&random, state.range(0), 256);
+    }
+    Block quantization_table;
+    for (auto&& row : quantization_table) {
+        row.fill(1);
+    }
+    auto table = IDCTTable(mode, quantization_table);
+    std::vector<uint8_t> samples(kRowWidth * BLOCK_SIZE);
+    for (auto _ : state) {
+        inverse_dct_row(blocks.data(), blocks.size(), table, samples.data(), kRowWidth);
+        benchmark::DoNotOptimize(samples.data());
+    }
+    state.SetItemsProcessed(state.iterations() * blocks.size());
+}
+BENCHMARK(BM_IDCTRow)->Apply([](auto* benchmark) {
+    for (int64_t nonzero : {1, 10, 64}) {
+        for (int64_t mode = 0; mode < static_cast<int64_t>(kIDCTModes); ++mode) {
+            KernelLevels(benchmark, {nonzero, mode});
+        }
+    }
+});
+
+/* Arguments are h and h_max of UpsampleRow and the CpuLevel */
+void BM_Upsample(benchmark::State& state) {
+    auto kernels = BenchmarkKernels(state, 2);
+    if (!kernels) {
+        return;
+    }
+    std::vector<uint8_t> input(kRowWidth, 100);
+    std::vector<uint8_t> output(kRowWidth);
+    for (auto _ : state) {
+        kernels->upsample_row(input.data(), state.range(0), state.range(1), kRowWidth,
+                              output.data());
+        benchmark::DoNotOptimize(output.data());
+    }
+    state.SetItemsProcessed(state.iterations() * kRowWidth);
+}
+BENCHMARK(BM_Upsample)->Apply([](auto* benchmark) {
+    for (auto factors : {std::vector<int64_t>{1, 1}, {1, 2}, {2, 3}}) {
+        KernelLevels(benchmark, factors);
+    }
+});
+
+void BM_ColorConvert(benchmark::State& state) {
+    auto kernels = BenchmarkKernels(state, 0);
+    if (!kernels) {
+        return;
+    }
+    std::mt19937 random(3);
+    std::vector<uint8_t> planes(kRowWidth * 3);
+    for (auto& sample : planes) {
+        sample = random();
+    }
+    std::vector<RGB> output(kRowWidth);
+    for (auto _ : state) {
+        kernels->convert_row(planes.data(), &planes[kRowWidth], &planes[2 * kRowWidth], kRowWidth,
+                             output.data());
+        benchmark::DoNotOptimize(output.data());
+    }
+    state.SetItemsProcessed(state.iterations() * kRowWidth);
+}
+BENCHMARK(BM_ColorConvert)->Apply([](auto* benchmark) {
+    KernelLevels(benchmark, {});
+});
+
+void BM_Decode(benchmark::State& state, const std::string& filename, size_t threads) {
+    DecoderContext context;
+    context.threads = threads;
+    size_t pixels = 0;
+    for (auto _ : state) {
+        auto& image = Decode(filename, &context);
+        pixels = image.Width() * image.Height();
+    }
+    state.SetBytesProcessed(state.iterations() * fs::file_size(filename));
+    state.counters["megapixels_per_second"] = benchmark::Counter(
+            pixels / 1e6, benchmark::Counter::kIsIterationInvariantRate);
+}
+
+/* Entropy decoding without pixel stages, from memory so bytes per second are those of the parser */
+void BM_Validate(benchmark::State& state, const std::string& filename) {
+    std::ifstream input(filename, std::ios::binary);
+    std::vector<uint8_t> data((std::istreambuf_iterator<char>(input)),
+                              std::istreambuf_iterator<char>());
+    DecoderContext context;
+    for (auto _ : state) {
+        auto result = Validate(data.data(), data.size(), &context);
+        benchmark::DoNotOptimize(result);
+    }
+    state.SetBytesProcessed(state.iterations() * data.size());
+}
+
+/* Lossless rewrite as a progressive file, bytes per second are those of the input */
+void BM_TranscodeToProgressive(benchmark::State& state, const std::string& filename) {
+    auto output = TempPath("bench_decoder_progressive.jpg");
+    for (auto _ : state) {
+        TranscodeToProgressive(filename, output);
+    }
+    state.SetBytesProcessed(state.iterations() * fs::file_size(filename));
+}
+
+void BM_Libjpeg(benchmark::State& state, const std::string& filename) {
+    size_t pixels = 0;
+    for (auto _ : state) {
+        auto image = ReadJpg(filename);
+        pixels = image.Width() * image.Height();
+    }
+    state.SetBytesProcessed(state.iterations() * fs::file_size(filename));
+    state.counters["megapixels_per_second"] = benchmark::Counter(
+            pixels / 1e6, benchmark::Counter::kIsIterationInvariantRate);
+}
+
+struct CorpusFile {
+    std::string name;
+    std::string filename;
+};
+
+/* Files of tests_dir that we can decode, progressive ones are skipped, and generated large ones */
+std::vector<CorpusFile> Corpus() {
+    std::vector<fs::path> paths;
+    if (fs::is_directory(tests_dir)) {
+        for (auto&& entry : fs::directory_iterator(tests_dir)) {
+            if (entry.path().extension() == ".jpg") {
+                paths.push_back(entry.path());
+            }
+        }
+    }
+    std::sort(paths.begin(), paths.end());
+
+    std::vector<CorpusFile> files;
+    for (auto&& path : paths) {
+        files.push_back({path.filename().string(), path.string()});
+    }
+    for (size_t size : {1024, 4096}) {
+        SyntheticJpegOptions options;
+        options.width = options.height = size;
+        auto name = SyntheticJpegName(options);
+        auto filename = TempPath("bench_decoder_" + name);
+        if (!fs::exists(filename)) {
+            WriteSyntheticJpeg(filename, options);
+        }
+        files.push_back({name, filename});
+    }
+
+    std::vector<CorpusFile> decodable;
+    for (auto&& file : files) {
+        try {
+            Decode(file.filename);
+            decodable.push_back(file);
+        } catch (const std::exception& error) {
+        }
+    }
+    return decodable;
+}
+
+void RegisterCorpus() {
+    for (auto&& file : Corpus()) {
+        benchmark::RegisterBenchmark(("BM_Decode/" + file.name).c_str(), BM_Decode, file.filename,
+                                     1)
+                ->Unit(benchmark::kMillisecond);
+        /* Latency, so wall time: the workers' CPU time isn't the calling thread's */
+        size_t threads = std::max(2u, std::thread::hardware_concurrency());
+        benchmark::RegisterBenchmark(("BM_DecodePipelined/" + file.name).c_str(), BM_Decode,
+                                     file.filename, threads)
+                ->Unit(benchmark::kMillisecond)
+                ->UseRealTime();
+        benchmark::RegisterBenchmark(("BM_Validate/" + file.name).c_str(), BM_Validate,
+                                     file.filename)
+                ->Unit(benchmark::kMillisecond);
+        benchmark::RegisterBenchmark(("BM_TranscodeToProgressive/" + file.name).c_str(),
+                                     BM_TranscodeToProgressive, file.filename)
+                ->Unit(benchmark::kMillisecond);
+        benchmark::RegisterBenchmark(("BM_Libjpeg/" + file.name).c_str(), BM_Libjpeg,
+                                     file.filename)
+                ->Unit(benchmark::kMillisecond);
+    }
+}
+
+/* Best of several runs taking at least 0.2 seconds together */
+template <typename Func>
+double MinSeconds(Func&& func) {
+    using Clock = std::chrono::steady_clock;
+    double best = INFINITY;
+    double total = 0;
+    for (size_t run = 0; run < 3 || total < 0.2; ++run) {
+        auto start = Clock::now();
+        func();
+        double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+        best = std::min(best, seconds);
+        total += seconds;
+    }
+    return best;
+}
+
+/* Decodes the file once with "ours", "libjpeg" or nothing at all, the exit status tells if it
+ * decoded */
+int PeakRSSRun(const std::string& decoder, const std::string& filename) {
+    try {
+        if (decoder == "ours") {
+            Decode(filename);
+        } else if (decoder == "libjpeg") {
+            ReadJpg(filename);
+        }
+    } catch (const std::exception& error) {
+        return 1;
+    }
+    return 0;
+}
+
+/* Peak RSS in kilobytes of a fresh process running PeakRSSRun, the memory this one has touched
+ * would hide the peaks otherwise. The child's maximum starts at the RSS it inherits from fork, so
+ * call this while holding no decoded images. */
+long PeakRSS(const std::string& decoder, const std::string& filename = "") {
+    auto binary = fs::read_symlink("/proc/self/exe").string();
+    auto run = "--peak_rss_run=" + decoder;
+    char* argv[] = {&binary[0], &run[0], const_cast<char*>(filename.c_str()), nullptr};
+    pid_t pid = fork();
+    if (pid < 0) {
+        throw std::runtime_error("Can't fork for " + binary);
+    }
+    if (pid == 0) {
+        execv(argv[0], argv);
+        _exit(127);
+    }
+    int status = 0;
+    rusage usage{};
+    if (wait4(pid, &status, 0, &usage) != pid || !WIFEXITED(status) || WEXITSTATUS(status)) {
+        throw std::runtime_error("Peak RSS run failed: " + run + " " + filename);
+    }
+    return usage.ru_maxrss;
+}
+
+/* Distance between RGB pixels as Compare in test_commons.h computes it */
+void PixelError(const Image& actual, const Image& expected, double* max, double* mean) {
+    if (actual.Width() != expected.Width() || actual.Height() != expected.Height()) {
+        throw std::runtime_error("Image sizes differ");
+    }
+    *max = 0;
+    *mean = 0;
+    for (size_t y = 0; y < actual.Height(); ++y) {
+        for (size_t x = 0; x < actual.Width(); ++x) {
+            auto lhs = actual.GetPixel(y, x);
+            auto rhs = expected.GetPixel(y, x);
+            auto diff = std::sqrt((lhs.r - rhs.r) * (lhs.r - rhs.r)
+                                  + (lhs.g - rhs.g) * (lhs.g - rhs.g)
+                                  + (lhs.b - rhs.b) * (lhs.b - rhs.b));
+            *max = std::max(*max, diff);
+            *mean += diff;
+        }
+    }
+    *mean /= actual.Width() * actual.Height();
+}
+
+/* One JSON record per file: speed relative to libjpeg above 1 means we are faster. Speed and
+ * error are of the default IDCT, "idct_modes" has them for every one. */
+void CompareWithLibjpeg() {
+    auto files = Corpus();
+    auto baseline_rss = PeakRSS("none");
+    std::printf("{\n  \"baseline_peak_rss_kb\": %ld,\n  \"files\": [", baseline_rss);
+    bool first = true;
+    for (auto&& file : files) {
+        auto rss = PeakRSS("ours", file.filename);
+        auto libjpeg_rss = PeakRSS("libjpeg", file.filename);
+        DecoderContext context;
+        double seconds = MinSeconds([&] { Decode(file.filename, &context); });
+        double libjpeg_seconds = MinSeconds([&] { ReadJpg(file.filename); });
+
+        auto expected = ReadJpg(file.filename);
+        auto& image = Decode(file.filename, &context);
+        double max_error, mean_error;
+        PixelError(image, expected, &max_error, &mean_error);
+
+        std::string modes;
+        for (size_t mode = 0; mode < kIDCTModes; ++mode) {
+            DecoderContext mode_context;
+            mode_context.idct_mode = static_cast<IDCTMode>(mode);
+            double mode_seconds = MinSeconds([&] { Decode(file.filename, &mode_context); });
+            double mode_max_error, mode_mean_error;
+            PixelError(Decode(file.filename, &mode_context), expected, &mode_max_error,
+                       &mode_mean_error);
+            char record[160];
+            std::snprintf(record, sizeof(record),
+                          "%s\"%s\": {\"ms\": %.3f, \"max_error\": %.3f, \"mean_error\": %.4f}",
+                          mode ? ", " : "", IDCTModeName(mode_context.idct_mode),
+                          mode_seconds * 1e3, mode_max_error, mode_mean_error);
+            modes += record;
+        }
+
+        std::printf("%s\n    {\"name\": \"%s\", \"bytes\": %zu, \"pixels\": %zu, "
+                    "\"ms\": %.3f, \"libjpeg_ms\": %.3f, \"relative_speed\": %.3f, "
+                    "\"peak_rss_kb\": %ld, \"libjpeg_peak_rss_kb\": %ld, "
+                    "\"max_error\": %.3f, \"mean_error\": %.4f, \"idct_modes\": {%s}}",
+                    first ? "" : ",", file.name.c_str(),
+                    static_cast<size_t>(fs::file_size(file.filename)),
+                    image.Width() * image.Height(), seconds * 1e3, libjpeg_seconds * 1e3,
+                    libjpeg_seconds / seconds, rss, libjpeg_rss, max_error, mean_error,
+                    modes.c_str());
+        first = false;
+    }
+    std::printf("\n  ]\n}\n");
+}
+
+}  // namespace
+
+/* Reports are JSON unless --benchmark_format says otherwise. --tests_dir sets the corpus,
+ * --compare_libjpeg prints speed, memory and pixel error against libjpeg instead. */
+int main(int argc, char** argv) {
+    if (argc == 3 && std::string(argv[1]).rfind("--peak_rss_run=", 0) == 0) {
+        return PeakRSSRun(std::string(argv[1]).substr(15), argv[2]);
+    }
+
+    std::vector<char*> args(argv, argv + argc);
+    bool has_format = false;
+    for (auto it = args.begin() + 1; it != args.end();) {
+        std::string arg = *it;
+        if (arg.rfind("--tests_dir=", 0) == 0) {
+            tests_dir = arg.substr(arg.find('=') + 1);
+            it = args.erase(it);
+            continue;
+        }
+        if (arg == "--compare_libjpeg") {
+            compare_libjpeg = true;
+            it = args.erase(it);
+            continue;
+        }
+        has_format |= arg.rfind("--benchmark_format=", 0) == 0;
+        ++it;
+    }
+    std::string json = "--benchmark_format=json";
+    if (!has_format) {
+        args.push_back(&json[0]);
+    }
+
+    int size = args.size();
+    benchmark::Initialize(&size, args.data());
+    if (benchmark::ReportUnrecognizedArguments(size, args.data())) {
+        return 1;
+    }
+    if (compare_libjpeg) {
+        CompareWithLibjpeg();
+        return 0;
+    }
+    RegisterCorpus();
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include "image.h"
+#include "idct.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+
+/* Nearest sample of a row thinned by h_max / h, as many as width */
+inline void UpsampleRow(const uint8_t* input, size_t h, size_t h_max, size_t width,
+                        uint8_t* output) {
+    if (h == h_max) {
+        std::copy(input, input + width, output);
+        return;
+    }
+    if (h_max % h == 0) {
+        size_t factor = h_max / h;
+        for (size_t x = 0; x < width; ++x) {
+            output[x] = input[x / factor];
+        }
+        return;
+    }
+    for (size_t x = 0; x < width; ++x) {
+        output[x] = input[x * h / h_max];
+    }
+}
+
+/* The same with h_max / h known to be kFactor */
+template <size_t kFactor>
+inline void UpsampleRowBy(const uint8_t* input, size_t width, uint8_t* output) {
+    for (size_t x = 0; x < width; ++x) {
+        output[x] = input[x / kFactor];
+    }
+}
+
+/* JFIF conversion in 16-bit fixed point, rounded to nearest */
+inline RGB YCbCrToRGB(int y, int cb, int cr) {
+    cb -= 128;
+    cr -= 128;
+    return {
+            ClampSample(y + ((91881 * cr + 32768) >> 16)),
+            ClampSample(y + ((-22554 * cb - 46802 * cr + 32768) >> 16)),
+            ClampSample(y + ((116130 * cb + 32768) >> 16))
+    };
+}
+
+inline void ConvertRow(const uint8_t* y, const uint8_t* cb, const uint8_t* cr, size_t width,
+                       RGB* output) {
+    for (size_t x = 0; x < width; ++x) {
+        output[x] = YCbCrToRGB(y[x], cb[x], cr[x]);
+    }
+}
+
+inline void ConvertGrayRow(const uint8_t* y, size_t width, RGB* output) {
+    for (size_t x = 0; x < width; ++x) {
+        output[x] = {y[x], y[x], y[x]};
+    }
+}
@@ -0,0 +1,112 @@
+#pragma once
+
+#include <cstdio>
+#include <jpeglib.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+enum class Subsampling {
+    k444,
+    k422,
+    k420,
+    k411
+};
+
+struct SyntheticJpegOptions {
+    size_t width = 1024;
+    size_t height = 1024;
+    Subsampling subsampling = Subsampling::k420;
+    int quality = 90;
+    /* In MCUs, 0 means no restart markers */
+    size_t restart_interval = 0;
+    bool progressive = false;
+};
+
+inline const char* SubsamplingName(Subsampling subsampling) {
+    switch (subsampling) {
+        case Subsampling::k444:
+            return "444";
+        case Subsampling::k422:
+            return "422";
+        case Subsampling::k420:
+            return "420";
+        default:
+            return "411";
+    }
+}
+
+inline std::string SyntheticJpegName(const SyntheticJpegOptions& options) {
+    return std::to_string(options.width) + "x" + std::to_string(options.height) + "_"
+           + SubsamplingName(options.subsampling) + "_q" + std::to_string(options.quality)
+           + (options.restart_interval ? "_rst" + std::to_string(options.restart_interval) : "")
+           + (options.progressive ? "_progressive" : "_baseline") + ".jpg";
+}
+
+/* Smooth gradients, a few sharp edges and noise, roughly as hard to compress as a photo.
+ * The same options always give the same file. Rows are written one at a time,
+ * so 16k x 16k images don't need the whole picture in memory. */
+inline void WriteSyntheticJpeg(const std::string& filename, const SyntheticJpegOptions& options) {
+    FILE* file = fopen(filename.c_str(), "wb");
+    if (!file) {
+        throw std::runtime_error("Can't open " + filename + " for writing");
+    }
+    jpeg_compress_struct cinfo;
+    jpeg_error_mgr err;
+    cinfo.err = jpeg_std_error(&err);
+    jpeg_create_compress(&cinfo);
+    jpeg_stdio_dest(&cinfo, file);
+
+    size_t width = options.width;
+    size_t height = options.height;
+    cinfo.image_width = width;
+    cinfo.image_height = height;
+    cinfo.input_components = 3;
+    cinfo.in_color_space = JCS_RGB;
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, options.quality, true);
+
+    static const int kFactors[][2] = {{1, 1}, {2, 1}, {2, 2}, {4, 1}};
+    auto& factors = kFactors[static_cast<int>(options.subsampling)];
+    cinfo.comp_info[0].h_samp_factor = factors[0];
+    cinfo.comp_info[0].v_samp_factor = factors[1];
+    for (int i = 1; i < 3; ++i) {
+        cinfo.comp_info[i].h_samp_factor = 1;
+        cinfo.comp_info[i].v_samp_factor = 1;
+    }
+    cinfo.restart_interval = options.restart_interval;
+    if (options.progressive) {
+        jpeg_simple_progression(&cinfo);
+    }
+    jpeg_start_compress(&cinfo, true);
+
+    std::mt19937 random(width * 7919 + height);
+    std::vector<uint8_t> row(width * 3);
+    while (cinfo.next_scanline < height) {
+        size_t y = cinfo.next_scanline;
+        double v = static_cast<double>(y) / height;
+        for (size_t x = 0; x < width; ++x) {
+            double u = static_cast<double>(x) / width;
+            double wave = 40 * std::sin(12 * u + 5 * v) * std::cos(9 * v - 3 * u);
+            int edge = ((x / 97 + y / 61) % 5 == 0) ? 60 : 0;
+            int noise = static_cast<int>(random() % 24) - 12;
+            int r = 255 * u + wave + edge + noise;
+            int g = 255 * v - wave + noise;
+            int b = 128 + wave * 2 - edge + noise;
+            row[x * 3] = std::min(255, std::max(0, r));
+            row[x * 3 + 1] = std::min(255, std::max(0, g));
+            row[x * 3 + 2] = std::min(255, std::max(0, b));
+        }
+        JSAMPROW pointer = row.data();
+        jpeg_write_scanlines(&cinfo, &pointer, 1);
+    }
+
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+    fclose(file);
+}
@@ -1,16 +1,14 @@
 #include "decoder.h"
 
-Image Decode(const std::string& filename) {
-    auto file = File(filename);
-    auto decoder = Decoder(std::move(file));
-
-    decoder.SOI();
-    decoder.APP0();
-    decoder.COM();
-    decoder.DQT();
-    decoder.DQT();
-    decoder.SOF0();
-    decoder.DHT();
+namespace {
+
+const Image& Decode(File&& file, DecoderContext* context, DecodeStats* stats) {
+    if (stats) {
+        *stats = DecodeStats();
+    }
+    auto decoder = Decoder(std::move(file), context, stats);
+
+    decoder.Parse();
 /*
     SOI(); // xFFD8 Start of Image
     APP0(); // xFFE0 ?
@@ -24,5 +22,145 @@ Image Decode(const std::string& filename) {
 
     EOI(); // End of Image xFFD9
     */
-    return Image();
-}
\ No newline at end of file
+    return context->image;
+}
+
+DecodeResult TryDecode(File&& file, DecoderContext* context, DecodeStats* stats) {
+    if (stats) {
+        *stats = DecodeStats();
+    }
+    auto decoder = Decoder(std::move(file), context, stats);
+    auto error = decoder.TryParse();
+    if (error != DecodeError::kNone) {
+        return error;
+    }
+    return context->image;
+}
+
+ValidationResult Validate(File&& file, DecoderContext* context) noexcept {
+    std::unique_ptr<Decoder> decoder;
+    try {
+        decoder = std::make_unique<Decoder>(std::move(file), context);
+        decoder->SetValidateOnly();
+        auto error = decoder->TryParse();
+        if (error == DecodeError::kNone) {
+            return {};
+        }
+        return {error, decoder->ErrorOffset()};
+    } catch (const std::exception& exception) {
+        auto error = DecodeError::kBadFile;
+        if (auto decode_exception = dynamic_cast<const DecodeException*>(&exception)) {
+            error = decode_exception->Error();
+        }
+        return {error, decoder ? decoder->ErrorOffset() : 0};
+    }
+}
+
+EntropyIndex BuildEntropyIndex(File&& file, size_t rows, DecoderContext* context) {
+    EntropyIndex index;
+    auto decoder = Decoder(std::move(file), context);
+    decoder.BuildIndex(&index, rows);
+    decoder.Parse();
+    return index;
+}
+
+EntropyIndex BuildRestartMarkerIndex(File&& file, size_t rows, DecoderContext* context) {
+    EntropyIndex index;
+    auto decoder = Decoder(std::move(file), context);
+    decoder.BuildIndexFromRestartMarkers(&index, rows);
+    decoder.Parse();
+    return index;
+}
+
+const Image& DecodeRows(File&& file, const EntropyIndex& index, size_t y, size_t height,
+                        DecoderContext* context) {
+    auto decoder = Decoder(std::move(file), context);
+    decoder.SetBand(index, y, height);
+    decoder.Parse();
+    return context->image;
+}
+
+}  // namespace
+
+Image Decode(const std::string& filename) {
+    DecoderContext context;
+    Decode(filename, &context);
+    return std::move(context.image);
+}
+
+Image Decode(const uint8_t* data, size_t size) {
+    DecoderContext context;
+    Decode(data, size, &context);
+    return std::move(context.image);
+}
+
+const Image& Decode(const std::string& filename, DecoderContext* context, DecodeStats* stats) {
+    return Decode(File(filename, &context->file_buffer), context, stats);
+}
+
+const Image& Decode(const uint8_t* data, size_t size, DecoderContext* context, DecodeStats* stats) {
+    return Decode(File(data, size), context, stats);
+}
+
+DecodeResult TryDecode(const std::string& filename, DecoderContext* context,
+                       DecodeStats* stats) noexcept {
+    try {
+        return TryDecode(File(filename, &context->file_buffer), context, stats);
+    } catch (const DecodeException& exception) {
+        return exception.Error();
+    } catch (const std::exception&) {
+        return DecodeError::kBadFile;
+    }
+}
+
+DecodeResult TryDecode(const uint8_t* data, size_t size, DecoderContext* context,
+                       DecodeStats* stats) noexcept {
+    try {
+        return TryDecode(File(data, size), context, stats);
+    } catch (const DecodeException& exception) {
+        return exception.Error();
+    } catch (const std::exception&) {
+        return DecodeError::kBadFile;
+    }
+}
+
+EntropyIndex BuildEntropyIndex(const std::string& filename, size_t rows, DecoderContext* context) {
+    return BuildEntropyIndex(File(filename, &context->file_buffer), rows, context);
+}
+
+EntropyIndex BuildEntropyIndex(const uint8_t* data, size_t size, size_t rows,
+                               DecoderContext* context) {
+    return BuildEntropyIndex(File(data, size), rows, context);
+}
+
+EntropyIndex BuildRestartMarkerIndex(const std::string& filename, size_t rows,
+                                     DecoderContext* context) {
+    return BuildRestartMarkerIndex(File(filename, &context->file_buffer), rows, context);
+}
+
+EntropyIndex BuildRestartMarkerIndex(const uint8_t* data, size_t size, size_t rows,
+                                     DecoderContext* context) {
+    return BuildRestartMarkerIndex(File(data, size), rows, context);
+}
+
+const Image& DecodeRows(const std::string& filename, const EntropyIndex& index, size_t y,
+                        size_t height, DecoderContext* context) {
+    return DecodeRows(File(filename, &context->file_buffer), index, y, height, context);
+}
+
+const Image& DecodeRows(const uint8_t* data, size_t size, const EntropyIndex& index, size_t y,
+                        size_t height, DecoderContext* context) {
+    return DecodeRows(File(data, size), index, y, height, context);
+}
+
+ValidationResult Validate(const std::string& filename, DecoderContext* context) noexcept {
+    try {
+        return Validate(File(filename, &context->file_buffer), context);
+    } catch (const std::exception&) {
+        return {DecodeError::kBadFile, 0};
+    }
+}
+
+ValidationResult Validate(const uint8_t* data, size_t size, DecoderContext* context) noexcept {
+    return Validate(File(data, size), context);
+}
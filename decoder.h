@@ -1,6 +1,12 @@
 #pragma once
 
 #include "image.h"
+#include "arena.h"
+#include "color.h"
+#include "dispatch.h"
+#include "stats.h"
+#include "pipeline.h"
+#include "entropy_index.h"
 #include <string>
 #include <fstream>
 #include <iostream>
@@ -9,8 +15,17 @@
 #include <bitset>
 #include <unordered_map>
 #include <list>
-
-constexpr size_t BLOCK_SIZE = 8;
+#include <array>
+#include <memory>
+#include <functional>
+#include <vector>
+#include <algorithm>
+#include <mutex>
+#include <shared_mutex>
+#include <stdexcept>
+#include <cstdint>
+#include <tuple>
+#include <utility>
 
 template <typename T = char[1]>
 void __print__(const T &prontable = "") {
@@ -41,16 +56,17 @@ void __print_table__(const T &table) {
 }
 
 template <class T>
-void ASSERT(const T& val, const std::string& error_message = "") {
+void ASSERT(const T& val, const char* error_message = "") {
     if (!val) {
         throw std::runtime_error(error_message);
     }
 }
 
-bool ASSERT_EQUALITY(bool val) {
+inline bool ASSERT_EQUALITY(bool val) {
     if (!val) {
         throw std::runtime_error("Expected equality!\n");
     }
+    return val;
 }
 
 template <class T>
@@ -63,28 +79,244 @@ void TEST(const std::string& test_name, T func) {
     }
 }
 
+enum class DecodeError {
+    kNone,
+    kUnexpectedEOF,
+    kUnexpectedMarker,
+    kBadHuffmanCode,
+    kCoefficientOverflow,
+    kBadRestartMarker,
+    kLimitExceeded,
+    /* Anything wrong outside of entropy-coded data */
+    kBadFile
+};
+
+inline const char* DecodeErrorMessage(DecodeError error) {
+    switch (error) {
+        case DecodeError::kNone:
+            return "No error";
+        case DecodeError::kUnexpectedEOF:
+            return "Unexpected EOF!";
+        case DecodeError::kUnexpectedMarker:
+            return "Unexpected marker in entropy-coded data";
+        case DecodeError::kBadHuffmanCode:
+            return "Bad Huffman code";
+        case DecodeError::kCoefficientOverflow:
+            return "Coefficient overflow";
+        case DecodeError::kBadRestartMarker:
+            return "Expected restart marker";
+        case DecodeError::kLimitExceeded:
+            return "Decode limit exceeded";
+        default:
+            return "Bad file";
+    }
+}
+
+class DecodeException : public std::runtime_error {
+public:
+    explicit DecodeException(DecodeError error, const char* message = nullptr)
+            : std::runtime_error(message ? message : DecodeErrorMessage(error)), error_(error) {}
+
+    DecodeError Error() const {
+        return error_;
+    }
+
+private:
+    DecodeError error_;
+};
+
+/* What TryDecode returns, spelled like std::expected<const Image&, DecodeError> */
+class DecodeResult {
+public:
+    DecodeResult(const Image& image) : image_(&image) {}
+    DecodeResult(DecodeError error) : error_(error) {}
+
+    bool has_value() const {
+        return image_;
+    }
+
+    explicit operator bool() const {
+        return has_value();
+    }
+
+    const Image& value() const {
+        if (!image_) {
+            throw DecodeException(error_);
+        }
+        return *image_;
+    }
+
+    const Image& operator*() const {
+        return *image_;
+    }
+
+    const Image* operator->() const {
+        return image_;
+    }
+
+    DecodeError error() const {
+        return error_;
+    }
+
+private:
+    const Image* image_ = nullptr;
+    DecodeError error_ = DecodeError::kNone;
+};
+
 Image Decode(const std::string& filename);
 
+/* Decodes bytes in memory, they aren't copied */
+Image Decode(const uint8_t* data, size_t size);
+
+struct DecoderContext;
+
+/* The image lives in the context until its next decode. Stats are collected when given. */
+const Image& Decode(const std::string& filename, DecoderContext* context,
+                    DecodeStats* stats = nullptr);
+const Image& Decode(const uint8_t* data, size_t size, DecoderContext* context,
+                    DecodeStats* stats = nullptr);
+
+/* Never throw. Corrupt entropy-coded data is reported without unwinding, so rejecting hostile
+ * files costs no more than decoding them; errors in marker segments are caught inside. */
+DecodeResult TryDecode(const std::string& filename, DecoderContext* context,
+                       DecodeStats* stats = nullptr) noexcept;
+DecodeResult TryDecode(const uint8_t* data, size_t size, DecoderContext* context,
+                       DecodeStats* stats = nullptr) noexcept;
+
+/* What Validate found wrong first and the offset of the byte it was found at */
+struct ValidationResult {
+    DecodeError error = DecodeError::kNone;
+    size_t offset = 0;
+
+    explicit operator bool() const {
+        return error == DecodeError::kNone;
+    }
+};
+
+/* Checks that the file decodes without decoding it: markers are parsed and every block is
+ * entropy-decoded, nothing is dequantized, transformed or allocated for the image. Tolerant
+ * mode and threads of the context don't apply. */
+ValidationResult Validate(const std::string& filename, DecoderContext* context) noexcept;
+ValidationResult Validate(const uint8_t* data, size_t size, DecoderContext* context) noexcept;
+
+/* Decodes the file like Decode and indexes it every rows MCU rows on the way */
+EntropyIndex BuildEntropyIndex(const std::string& filename, size_t rows, DecoderContext* context);
+EntropyIndex BuildEntropyIndex(const uint8_t* data, size_t size, size_t rows,
+                               DecoderContext* context);
+
+/* The same index of a file whose restart intervals start every rows-th MCU row, without
+ * decoding it: checkpoints are at the restart markers, found by scanning for 0xFF bytes. Bands
+ * between them can then be decoded in parallel from the start. */
+EntropyIndex BuildRestartMarkerIndex(const std::string& filename, size_t rows,
+                                     DecoderContext* context);
+EntropyIndex BuildRestartMarkerIndex(const uint8_t* data, size_t size, size_t rows,
+                                     DecoderContext* context);
+
+/* Pixel rows [y, y + height) of a single-scan file, decoded from the closest checkpoint above
+ * them. The image is height rows high. */
+const Image& DecodeRows(const std::string& filename, const EntropyIndex& index, size_t y,
+                        size_t height, DecoderContext* context);
+const Image& DecodeRows(const uint8_t* data, size_t size, const EntropyIndex& index, size_t y,
+                        size_t height, DecoderContext* context);
+
+/* Stream buffer over bytes owned by someone else */
+class MemoryBuffer : public std::streambuf {
+public:
+    MemoryBuffer() = default;
+
+    MemoryBuffer(const uint8_t* data, size_t size) {
+        auto begin = reinterpret_cast<char*>(const_cast<uint8_t*>(data));
+        setg(begin, begin, begin + size);
+    }
+
+    /* The bytes were moved or grew, reading goes on at the same offset */
+    void Rebind(const uint8_t* data, size_t size) {
+        auto offset = gptr() - eback();
+        auto begin = reinterpret_cast<char*>(const_cast<uint8_t*>(data));
+        setg(begin, begin + offset, begin + size);
+    }
+
+    /* The bytes from the position on, read in place */
+    std::pair<const uint8_t*, size_t> Window() {
+        return {reinterpret_cast<const uint8_t*>(gptr()), egptr() - gptr()};
+    }
+
+    void Advance(size_t count) {
+        setg(eback(), gptr() + count, egptr());
+    }
+
+protected:
+    pos_type seekoff(off_type offset, std::ios_base::seekdir direction,
+                     std::ios_base::openmode) override {
+        char* base = direction == std::ios_base::beg ? eback()
+                     : direction == std::ios_base::cur ? gptr() : egptr();
+        if (offset < eback() - base || offset > egptr() - base) {
+            return pos_type(off_type(-1));
+        }
+        setg(eback(), base + offset, egptr());
+        return gptr() - eback();
+    }
+
+    pos_type seekpos(pos_type position, std::ios_base::openmode mode) override {
+        return seekoff(position, std::ios_base::beg, mode);
+    }
+};
+
+/* A file buffer whose bytes read ahead can be read in place */
+class FileBuffer : public std::filebuf {
+public:
+    /* Empty at the end of the file only */
+    std::pair<const uint8_t*, size_t> Window() {
+        if (gptr() == egptr() && sgetc() == traits_type::eof()) {
+            return {nullptr, 0};
+        }
+        return {reinterpret_cast<const uint8_t*>(gptr()), egptr() - gptr()};
+    }
+
+    void Advance(size_t count) {
+        gbump(static_cast<int>(count));
+    }
+};
+
 class File {
 public:
     File() = delete;
     File(File&) = delete;
     File(File&& file)
-            : file_stream_(std::move(file.file_stream_))
+            : file_buffer_(std::move(file.file_buffer_))
+            , memory_buffer_(file.memory_buffer_)
+            , stream_(file.stream_.rdbuf() == &file.memory_buffer_
+                      ? static_cast<std::streambuf*>(&memory_buffer_) : &file_buffer_)
             , curr_byte_(file.curr_byte_)
-            , bit_counter_(file.bit_counter_) {}
+            , bit_counter_(file.bit_counter_) {
+        stream_.clear(file.stream_.rdstate());
+    }
 
     File(const std::string& filename)
-            : file_stream_(filename)
+            : stream_(&file_buffer_)
             , curr_byte_(0)
             , bit_counter_(0) {
-        if (!file_stream_.is_open()) {
-            throw std::runtime_error("Can not open file!");
-        }
+        Open(filename);
+    }
+
+    /* Reads through the given buffer instead of allocating one */
+    File(const std::string& filename, std::vector<char>* buffer)
+            : stream_(&file_buffer_)
+            , curr_byte_(0)
+            , bit_counter_(0) {
+        file_buffer_.pubsetbuf(buffer->data(), buffer->size());
+        Open(filename);
     }
 
+    /* Reads the bytes in place, they have to outlive the file */
+    File(const uint8_t* data, size_t size)
+            : memory_buffer_(data, size)
+            , stream_(&memory_buffer_)
+            , curr_byte_(0)
+            , bit_counter_(0) {}
+
     uint8_t GetByte() {
-        if (file_stream_.peek() == EOF) {
+        if (stream_.peek() == EOF) {
             throw std::runtime_error("Unexpected EOF!");
         }
         if (bit_counter_) {
@@ -92,7 +324,7 @@ public:
         }
 
         char byte;
-        file_stream_.read(&byte, 1);
+        stream_.read(&byte, 1);
         curr_byte_ = byte;
 
         return curr_byte_;
@@ -121,9 +353,59 @@ public:
         return word;
     }
 
+    /* tellg fails once a peek has hit EOF */
+    size_t Position() {
+        stream_.clear(stream_.rdstate() & ~std::ios::eofbit);
+        return stream_.tellg();
+    }
+
+    void Seek(size_t position) {
+        stream_.seekg(position);
+    }
+
+    /* Bytes left in a file read from memory */
+    size_t Remaining() {
+        return std::max<std::streamsize>(0, stream_.rdbuf()->in_avail());
+    }
+
+    void Rebind(const uint8_t* data, size_t size) {
+        memory_buffer_.Rebind(data, size);
+        stream_.clear();
+    }
+
+    /* Bytes from the position on that can be read without a copy, at least one unless at the
+     * end of the file. The file moves past them with Advance. */
+    std::pair<const uint8_t*, size_t> Window() {
+        if (stream_.rdbuf() == &memory_buffer_) {
+            return memory_buffer_.Window();
+        }
+        return file_buffer_.Window();
+    }
+
+    void Advance(size_t count) {
+        if (stream_.rdbuf() == &memory_buffer_) {
+            memory_buffer_.Advance(count);
+        } else {
+            file_buffer_.Advance(count);
+        }
+    }
+
+    /* EOF at the end of the file */
+    int PeekByte() {
+        return stream_.peek();
+    }
+
+    uint16_t PeekWord() {
+        auto position = stream_.tellg();
+        auto word = GetWord();
+        stream_.seekg(position);
+
+        return word;
+    }
+
     std::string ReadString(size_t size) {
         char c_str[size + 1];
-        file_stream_.read(c_str, size);
+        stream_.read(c_str, size);
         auto str = std::string(c_str, c_str + size);
         if (str.size() != size) {
             throw std::runtime_error("Unexpected EOF!");
@@ -132,6 +414,14 @@ public:
         return str;
     }
 
+    void ReadString(size_t size, std::string* str) {
+        str->resize(size);
+        stream_.read(&(*str)[0], size);
+        if (static_cast<size_t>(stream_.gcount()) != size) {
+            throw std::runtime_error("Unexpected EOF!");
+        }
+    }
+
     uint8_t GetHalfByte() {
         uint8_t byte = 0;
         for (size_t i = 0; i < 4; ++i) {
@@ -146,11 +436,11 @@ public:
         }
         if (n / 8) {
             for (size_t i = 0; i < n / 8; ++i) {
-                if (file_stream_.peek() == EOF) {
+                if (stream_.peek() == EOF) {
                     throw std::runtime_error("Unexpected EOF!");
                 }
                 char byte;
-                file_stream_.read(&byte, 1);
+                stream_.read(&byte, 1);
                 curr_byte_ = byte;
             }
         }
@@ -162,324 +452,484 @@ public:
     }
 
 private:
-    std::ifstream file_stream_;
+    void Open(const std::string& filename) {
+        if (!file_buffer_.open(filename, std::ios::in | std::ios::binary)) {
+            throw std::runtime_error("Can not open file!");
+        }
+    }
+
+    FileBuffer file_buffer_;
+    MemoryBuffer memory_buffer_;
+    std::istream stream_;
 
     uint8_t curr_byte_;
     size_t bit_counter_;
 };
 
-class HuffmanTree {
-    struct Node;
+/* BITS and HUFFVAL lists of DHT */
+struct HuffmanTable {
+    std::array<uint8_t, 16> counts{};
+    std::array<uint8_t, 256> values{};
 
-public:
-    HuffmanTree() = default;
+    constexpr size_t NumberOfCodes() const {
+        size_t number_of_codes = 0;
+        for (auto count : counts) {
+            number_of_codes += count;
+        }
+        return number_of_codes;
+    }
 
-    HuffmanTree(const std::vector<std::list<uint8_t>>& table, bool verbosity = false)
-            : table_(table), root_(std::make_shared<Node>()), curr_(root_), verbosity_(verbosity) {
-        Fill(root_);
+    friend bool operator==(const HuffmanTable& lhs, const HuffmanTable& rhs) {
+        return lhs.counts == rhs.counts &&
+               std::equal(lhs.values.begin(), lhs.values.begin() + lhs.NumberOfCodes(),
+                          rhs.values.begin());
     }
+};
 
-    void Fill(std::shared_ptr<Node> node, size_t depth = 0) {
-        if (depth == 17) {
-            throw std::runtime_error("Too large table");
-        }
-        ++counter;
-        if (depth == 0 || table_[depth - 1].empty()) {
-            if (!table_.number_of_codes) {
-                if (verbosity_) {
-                    std::cout << "\"NULL\";\n";
-                }
-                return;
-            }
-            node->left = std::make_shared<Node>();
-            node->right = std::make_shared<Node>();
-            auto temp_counter = counter;
-            if (verbosity_) {
-                std::cout << "\"NULL" << temp_counter << "\" -> ";
-            }
-            Fill(node->left, depth + 1);
-            if (verbosity_) {
-                std::cout << "\"NULL" << temp_counter << "\" -> ";
-            }
-            Fill(node->right, depth + 1);
-            return;
-        }
+/* Reads entropy-coded data ahead of the decoder: stuffed zero bytes are dropped and
+ * the stream is never advanced past a marker, so the file is positioned at it after Reset */
+class BitReader {
+public:
+    explicit BitReader(File* file) : file_(file) {}
 
-        node->value = table_[depth - 1].front();
-        if (verbosity_) {
-            std::cout << "\"" << node->value - 0 << "\";\n";
+    /* Bits past a marker or EOF read as zeros until they are consumed */
+    uint32_t PeekBits(size_t n) {
+        if (size_ < n) {
+            Fill();
         }
-
-        table_[depth - 1].pop_front();
-        --table_.number_of_codes;
+        uint32_t mask = (1u << n) - 1;
+        if (size_ < n) {
+            return static_cast<uint32_t>(buffer_ << (n - size_)) & mask;
+        }
+        return static_cast<uint32_t>(buffer_ >> (size_ - n)) & mask;
     }
 
-    uint8_t DecodeNext(File* file) {
-        curr_ = root_;
-        while (curr_->left != nullptr || curr_->right != nullptr) {
-            auto bit = file->GetBit();
-            /*
-            std::cout << (curr_->left == nullptr);
-            std::cout << ' ';
-            std::cout << (curr_->right == nullptr);
-            std::cout << ' ';
-            __print__(bit-0);*/
-            if (bit) {
-                ASSERT(curr_->right, "Right");
-                curr_ = curr_->right;
-            } else {
-                ASSERT(curr_->left, "Left");
-                curr_ = curr_->left;
+    void SkipBits(size_t n) {
+        if (size_ < n) {
+            Fill();
+            if (size_ < n) {
+                /* The offset of the error is that of the marker or the end the bits ran into */
+                size_ = 0;
+                Fail(eof_ ? DecodeError::kUnexpectedEOF : DecodeError::kUnexpectedMarker);
+                return;
             }
         }
-        /*
-        std::cout << (curr_->left == nullptr);
-        std::cout << ' ';
-        std::cout << (curr_->right == nullptr);
-        std::cout << ' ';
-        __print__();
-         */
-        auto res = curr_->value;
-        return res;
+        size_ -= n;
     }
 
-private:
-    struct Node {
-        std::shared_ptr<Node> left = nullptr;
-        std::shared_ptr<Node> right = nullptr;
-        uint8_t value =  255;
-    };
+    uint32_t GetBits(size_t n) {
+        auto bits = PeekBits(n);
+        SkipBits(n);
+        return bits;
+    }
 
-    struct HuffmanTable : public std::vector<std::list<uint8_t>> {
-        HuffmanTable() = default;
+    uint8_t GetBit() {
+        return GetBits(1);
+    }
 
-        HuffmanTable(const std::vector<std::list<uint8_t>>& table)
-                : std::vector<std::list<uint8_t>>(table), number_of_codes(0) {
-            for (auto&& list : *this) {
-                number_of_codes += list.size();
-            }
+    /* Errors are sticky and don't stop reading, past one everything reads as zeros.
+     * The decoder checks once per MCU instead of unwinding from every bit. */
+    void Fail(DecodeError error) {
+        if (error_ == DecodeError::kNone) {
+            error_ = error;
+            error_offset_ = Tell().first;
         }
+    }
 
-        size_t number_of_codes;
-    };
-
-    bool verbosity_;
-    int counter = 0;
-
-    std::shared_ptr<Node> root_;
-    std::shared_ptr<Node> curr_;
-
-    HuffmanTable table_;
-};
+    DecodeError Error() const {
+        return error_;
+    }
 
-class Decoder {
-public:
-    Decoder(File&& file)
-            : file_(std::move(file))
-            , tables_(2, std::vector<std::vector<std::list<uint8_t>>>(2))
-            , trees_(2, std::vector<HuffmanTree>(2))
-            , quantification_tables_(2) {}
+    size_t ErrorOffset() const {
+        return error_offset_;
+    }
 
-    void SOI() {
-        AssertNextWord(0xFFD8, "Expected SOI");
+    /* Drops the rest of the current byte and the error, called before a marker is read */
+    void Reset() {
+        buffer_ = 0;
+        size_ = 0;
+        at_marker_ = false;
+        eof_ = false;
+        error_ = DecodeError::kNone;
+        clear_ = 0;
     }
 
-    void APP0() {
-        AssertNextWord(0xFFE0, "Expected APP0");
-        GetCurrStructureLen();
-        for (auto i = 0; i < curr_struct_len; ++i) {
-            file_.GetByte();
+    /* Where the next bit comes from: the offset of its byte in the file and the bits of that byte
+     * already read. The bytes read ahead are stepped back over, stuffed zeros included. */
+    std::pair<size_t, size_t> Tell() const {
+        size_t offset = file_->Position();
+        for (size_t i = 0; i < (size_ + 7) / 8; ++i) {
+            offset -= static_cast<uint8_t>(buffer_ >> (8 * i)) == 0xFF ? 2 : 1;
         }
+        return {offset, (8 - size_ % 8) % 8};
     }
 
-    void COM() {
-        AssertNextWord(0xFFFE, "Expected COM");
-        GetCurrStructureLen();
-        auto comment = file_.ReadString(curr_struct_len);
-        image_.SetComment(comment);
+    void Seek(size_t offset, size_t bit) {
+        Reset();
+        file_->Seek(offset);
+        SkipBits(bit);
     }
 
-    void DQT() {
-        AssertNextWord(0xFFDB, "Expected DQT");
-        GetCurrStructureLen();
-
-        bool is_one_byte_sized = !file_.GetHalfByte();
-        AssertBit(is_one_byte_sized);
-        auto id = file_.GetHalfByte();
-        AssertBit(id);
-
-        size_t size = std::lround(std::sqrt(curr_struct_len - 1));
-        if (size * size != curr_struct_len - 1 || size != BLOCK_SIZE) {
-            throw std::runtime_error("Incorrect size of QT");
+    /* The file grew, what looked like its end is read on */
+    void MoreInput() {
+        if (eof_) {
+            at_marker_ = eof_ = false;
         }
+    }
 
-        if (is_one_byte_sized) {
-            FillQTWith(quantification_tables_[id], file_, &File::GetByte, size);
-        } else {
-            FillQTWith(quantification_tables_[id], file_, &File::GetWord, size);
+private:
+    /* Bytes are taken 8 at a time while the window of the file is known to hold no 0xFF for
+     * them, one at a time through stuffing and markers otherwise */
+    void Fill() {
+        if (size_ <= 56 && !at_marker_) {
+            if (clear_ < 8) {
+                auto window = file_->Window();
+                clear_ = find_marker_byte_(window.first, window.second);
+            }
+            if (clear_ >= 8) {
+                FillWord();
+                return;
+            }
+        }
+        while (size_ <= 56 && !at_marker_) {
+            auto byte = file_->PeekByte();
+            if (byte == EOF) {
+                at_marker_ = eof_ = true;
+                break;
+            }
+            if (byte == 0xFF) {
+                auto position = file_->Position();
+                file_->GetByte();
+                auto next = file_->PeekByte();
+                if (next != 0x00) {
+                    file_->Seek(position);
+                    at_marker_ = true;
+                    eof_ = next == EOF;
+                    break;
+                }
+                file_->GetByte();
+            } else {
+                file_->GetByte();
+            }
+            buffer_ = (buffer_ << 8) | static_cast<uint8_t>(byte);
+            size_ += 8;
         }
+        clear_ = 0;
     }
 
-    void SOF0() {
-        AssertNextWord(0xFFC0, "Expected SOF0");
-        GetCurrStructureLen();
-
-        precision_ = file_.GetByte();
-        size_t height_ = file_.GetWord();
-        size_t width_ = file_.GetWord();
-        numer_of_components_ = file_.GetByte();
+    /* As many of the next 8 bytes as there is room for, none of them is 0xFF */
+    void FillWord() {
+        auto data = file_->Window().first;
+        uint64_t word = 0;
+        for (size_t i = 0; i < 8; ++i) {
+            word = (word << 8) | data[i];
+        }
+        size_t count = (64 - size_) / 8;
+        buffer_ = count == 8 ? word : (buffer_ << (8 * count)) | (word >> (64 - 8 * count));
+        size_ += 8 * count;
+        clear_ -= count;
+        file_->Advance(count);
+    }
 
-        image_.SetSize(width_, height_);
+    File* file_;
+    size_t (*find_marker_byte_)(const uint8_t* data, size_t size) = GetKernels().find_marker_byte;
+
+    uint64_t buffer_ = 0;
+    size_t size_ = 0;
+    bool at_marker_ = false;
+    bool eof_ = false;
+    DecodeError error_ = DecodeError::kNone;
+    size_t error_offset_ = 0;
+    /* Bytes from the position of the file on that hold no 0xFF, 0 if not known */
+    size_t clear_ = 0;
+};
 
-        for (size_t i = 0; i < numer_of_components_; ++i) {
-            components_.emplace_back(file_.GetByte(), file_.GetHalfByte(),
-                                     file_.GetHalfByte(), file_.GetByte());
-            hth_max = std::max(hth_max, components_.back().hth);
-            vth_max = std::max(vth_max, components_.back().vth);
+struct HuffmanTableHash {
+    size_t operator()(const HuffmanTable& table) const {
+        /* FNV-1a over the bytes of DHT */
+        uint64_t hash = 14695981039346656037ull;
+        auto add = [&hash](uint8_t byte) {
+            hash = (hash ^ byte) * 1099511628211ull;
+        };
+        for (auto count : table.counts) {
+            add(count);
         }
-
+        for (size_t i = 0; i < table.NumberOfCodes(); ++i) {
+            add(table.values[i]);
+        }
+        return hash;
     }
+};
 
-    void DHT() {
-        AssertNextWord(0xFFC4, "Expected DHT");
-        GetCurrStructureLen();
-
-        bool is_AC = file_.GetHalfByte();
-        AssertBit(is_AC);
-        TableType type = (is_AC) ? AC : DC;
+/* Canonical decoder of Annex F.2.2.3 with a lookup table for codes up to kLookupBits long.
+ * Immutable once built, so one instance may be shared by any number of decoders. */
+class HuffmanDecoder {
+public:
+    static constexpr size_t kLookupBits = 9;
 
-        size_t table_id = file_.GetHalfByte();
-        if (table_id > 1) {
-            throw std::runtime_error("Bad table id");
+    explicit constexpr HuffmanDecoder(const HuffmanTable& table) {
+        if (table.NumberOfCodes() > table.values.size()) {
+            throw std::runtime_error("Too large table");
         }
-
-        std::vector<size_t> number_of_huffman_codes(16);
-        for (size_t i = 0; i < 16; ++i) {
-            number_of_huffman_codes[i] = file_.GetByte();
+        int32_t code = 0;
+        size_t k = 0;
+        for (size_t len = 1; len <= 16; ++len) {
+            value_offset_[len] = k - code;
+            for (size_t i = 0; i < table.counts[len - 1]; ++i, ++code, ++k) {
+                /* The all-ones code is reserved */
+                if (code >= (1 << len) - 1) {
+                    throw std::runtime_error("Bad Huffman table");
+                }
+                values_[k] = table.values[k];
+                if (len <= kLookupBits) {
+                    size_t shift = kLookupBits - len;
+                    for (size_t j = 0; j < (1u << shift); ++j) {
+                        lookup_[(code << shift) | j] = {static_cast<uint8_t>(len), values_[k]};
+                    }
+                }
+            }
+            max_code_[len] = table.counts[len - 1] ? code - 1 : -1;
+            code <<= 1;
+        }
+        for (size_t bits = 0; bits < lookup_.size(); ++bits) {
+            auto entry = lookup_[bits];
+            size_t size = entry.value & 0x0F;
+            if (!entry.length || entry.length + size > kLookupBits) {
+                continue;
+            }
+            int32_t coef = (bits >> (kLookupBits - entry.length - size)) & ((1 << size) - 1);
+            if (size && !(coef & (1 << (size - 1)))) {
+                coef -= (1 << size) - 1;
+            }
+            ac_lookup_[bits] = {static_cast<uint8_t>(entry.length + size),
+                                static_cast<uint8_t>(entry.value >> 4),
+                                static_cast<int16_t>(coef)};
         }
+    }
 
-        tables_[type][table_id].resize(16);
+    uint8_t DecodeNext(BitReader* reader) const {
+        auto entry = lookup_[reader->PeekBits(kLookupBits)];
+        if (entry.length) {
+            reader->SkipBits(entry.length);
+            return entry.value;
+        }
 
-        for (size_t i = 0; i < 16; ++i) {
-            for (size_t j = 0; j < number_of_huffman_codes[i]; ++j) {
-                tables_[type][table_id][i].push_back(file_.GetByte());
+        int32_t code = reader->GetBits(kLookupBits);
+        for (size_t len = kLookupBits + 1; len <= 16; ++len) {
+            code = (code << 1) | reader->GetBit();
+            if (code <= max_code_[len]) {
+                return values_[value_offset_[len] + code];
             }
         }
+        reader->Fail(DecodeError::kBadHuffmanCode);
+        return 0;
+    }
 
-        trees_[type][table_id] = HuffmanTree(tables_[type][table_id]);
+    /* An AC code and the magnitude bits after it in one lookup, when both fit in it: the zeros
+     * before the coefficient and the coefficient, 0 for EOB and ZRL. False with nothing read
+     * otherwise, DecodeNext takes the code then. */
+    bool DecodeAC(BitReader* reader, size_t* zeros, int* coef) const {
+        auto entry = ac_lookup_[reader->PeekBits(kLookupBits)];
+        if (!entry.length) {
+            return false;
+        }
+        reader->SkipBits(entry.length);
+        *zeros = entry.run;
+        *coef = entry.coef;
+        return true;
     }
 
-    void SOS() {
-        AssertNextWord(0xFFDA, "Expected Start of Scan");
-        GetCurrStructureLen();
+private:
+    struct Entry {
+        uint8_t length = 0;
+        uint8_t value = 0;
+    };
 
-        AssertNextByte(0x03, "Only 3 components can be supported");
+    struct ACEntry {
+        /* Of the code and the magnitude bits */
+        uint8_t length = 0;
+        uint8_t run = 0;
+        int16_t coef = 0;
+    };
 
-        for (size_t i = 0; i < 3; ++i) {
-            size_t component_id = file_.GetByte();
-            if (component_id == 0 || component_id > 3) {
-                throw std::runtime_error("Wrong component id");
-            }
-            --component_id;
-            components_[component_id].trees.resize(2);
-            auto DC_table_id = file_.GetHalfByte();
-            AssertBit(DC_table_id);
-            components_[component_id].trees[DC] = trees_[DC][DC_table_id];
-            auto AC_table_id = file_.GetHalfByte();
-            AssertBit(DC_table_id);
-            components_[component_id].trees[AC] = trees_[AC][AC_table_id];
-        }
+    std::array<Entry, 1 << kLookupBits> lookup_{};
+    std::array<ACEntry, 1 << kLookupBits> ac_lookup_{};
 
-        for (size_t i = 0; i < 3; ++i) {
-            if (components_[i].trees.empty()) {
-                throw std::runtime_error("Same components are detected");
-            }
-            file_.GetByte();
-        }
+    /* Indexed by code length */
+    std::array<int32_t, 17> max_code_{};
+    std::array<int32_t, 17> value_offset_{};
+    std::array<uint8_t, 256> values_{};
+};
 
+/* Annex K.3 tables, which most encoders write as they are */
+namespace standard_huffman {
 
-        /* Odd number of components may emerge while thinning */
+inline constexpr HuffmanTable kLuminanceDC = {
+        {0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0},
+        {
+            0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b
+        }
+};
 
-        auto number_of_Y_components_h = GetNumberOfComponentsByOneDimension(
-                image_.Width(), hth_max);
-        auto number_of_Y_components_v = GetNumberOfComponentsByOneDimension(
-                image_.Height(), vth_max);
+inline constexpr HuffmanTable kChrominanceDC = {
+        {0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0},
+        {
+            0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b
+        }
+};
 
-        std::vector<std::vector<int>> MCU;
-        for (size_t i = 0; i < number_of_Y_components_h; ++i) {
-            for (size_t j = 0; j < number_of_Y_components_v; ++j) {
-                for (size_t i_1 = 0; i_1 < components_[0].vth; ++i_1) {
-                    std::vector<std::vector<int>> row_of_blocks(8);
-                    for (size_t j_1 = 0; j_1 < components_[0].hth; ++j_1) {
-                        std::vector<std::vector<int>> comp(8, std::vector<int>(8));
-                        ReadDC(comp, 0);
-                        ReadAC(comp, 0);
-                        Dequant(comp, components_[0].qt_id);
-                        InplaceHstack(row_of_blocks, comp);
-                    }
-                    InplaceVstack(MCU, row_of_blocks);
-                }
-            }
+inline constexpr HuffmanTable kLuminanceAC = {
+        {0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 125},
+        {
+            0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31, 0x41, 0x06,
+            0x13, 0x51, 0x61, 0x07, 0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xa1, 0x08,
+            0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0, 0x24, 0x33, 0x62, 0x72,
+            0x82, 0x09, 0x0a, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x25, 0x26, 0x27, 0x28,
+            0x29, 0x2a, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45,
+            0x46, 0x47, 0x48, 0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59,
+            0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a, 0x73, 0x74, 0x75,
+            0x76, 0x77, 0x78, 0x79, 0x7a, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+            0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3,
+            0xa4, 0xa5, 0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6,
+            0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9,
+            0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe1, 0xe2,
+            0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf1, 0xf2, 0xf3, 0xf4,
+            0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa
         }
+};
 
-        int counter = 0;
-        /*while (true) {
-            __print__(counter++);
-            file_.GetByte();
-        }*/
+inline constexpr HuffmanTable kChrominanceAC = {
+        {0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 119},
+        {
+            0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31, 0x06, 0x12, 0x41,
+            0x51, 0x07, 0x61, 0x71, 0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91,
+            0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33, 0x52, 0xf0, 0x15, 0x62, 0x72, 0xd1,
+            0x0a, 0x16, 0x24, 0x34, 0xe1, 0x25, 0xf1, 0x17, 0x18, 0x19, 0x1a, 0x26,
+            0x27, 0x28, 0x29, 0x2a, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44,
+            0x45, 0x46, 0x47, 0x48, 0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58,
+            0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a, 0x73, 0x74,
+            0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
+            0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a,
+            0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4,
+            0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5, 0xc6, 0xc7,
+            0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda,
+            0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf2, 0xf3, 0xf4,
+            0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa
+        }
+};
+
+inline constexpr HuffmanDecoder kLuminanceDCDecoder(kLuminanceDC);
+inline constexpr HuffmanDecoder kChrominanceDCDecoder(kChrominanceDC);
+inline constexpr HuffmanDecoder kLuminanceACDecoder(kLuminanceAC);
+inline constexpr HuffmanDecoder kChrominanceACDecoder(kChrominanceAC);
+
+}  // namespace standard_huffman
 
+/* Decoder bound to a table known at compile time, so its constants are inlined */
+template <const HuffmanDecoder& kDecoder>
+struct StaticHuffmanDecoder {
+    uint8_t DecodeNext(BitReader* reader) const {
+        return kDecoder.DecodeNext(reader);
     }
 
-    void EOI() {
-        AssertNextWord(0xFFD9, "Expected End of Image");
+    bool DecodeAC(BitReader* reader, size_t* zeros, int* coef) const {
+        return kDecoder.DecodeAC(reader, zeros, coef);
     }
+};
 
-    void GetCurrStructureLen() {
-        curr_struct_len = static_cast<uint16_t>(file_.GetWord()) - 2;
+enum class StandardTables {
+    kNone,
+    kLuminance,
+    kChrominance
+};
+
+/* Process-wide cache of built decoders keyed by the contents of DHT.
+ * Files from the same encoder carry the same tables, so most DHT segments are hits. */
+class HuffmanDecoderCache {
+public:
+    static constexpr size_t kMaxSize = 1024;
+
+    static HuffmanDecoderCache& Instance() {
+        static HuffmanDecoderCache cache;
+        return cache;
     }
 
-    void AssertBit(uint val) {
-        if ((val & static_cast<uint>(-2)) != 0) {
-            throw std::runtime_error("Expected 1 or 0");
+    std::shared_ptr<const HuffmanDecoder> Get(const HuffmanTable& table) {
+        {
+            std::shared_lock<std::shared_mutex> lock(mutex_);
+            auto it = decoders_.find(table);
+            if (it != decoders_.end()) {
+                return it->second;
+            }
         }
-    }
 
-    void AssertNextByte(uint8_t val, const std::string& error_message = std::string()) {
-        auto byte = file_.GetByte();
-        if (byte != val) {
-            throw std::runtime_error(error_message);
+        auto decoder = std::make_shared<const HuffmanDecoder>(table);
+        std::unique_lock<std::shared_mutex> lock(mutex_);
+        /* Unusual tables beyond the limit are built per use instead of growing the cache */
+        if (decoders_.size() >= kMaxSize) {
+            return decoder;
         }
+        return decoders_.emplace(table, std::move(decoder)).first->second;
     }
 
-    void AssertNextWord(uint16_t val, const std::string& error_message = std::string()) {
-        auto word = file_.GetWord();
-        if (word != val) {
-            throw std::runtime_error(error_message);
-        }
+    size_t Size() const {
+        std::shared_lock<std::shared_mutex> lock(mutex_);
+        return decoders_.size();
     }
 
-    static void RunTests();
+    void Clear() {
+        std::unique_lock<std::shared_mutex> lock(mutex_);
+        decoders_.clear();
+    }
 
 private:
-    enum TableType {
-        DC = 0,
-        AC = 1
-    };
+    HuffmanDecoderCache() = default;
 
-    File file_;
-    size_t curr_struct_len;
+    mutable std::shared_mutex mutex_;
+    std::unordered_map<HuffmanTable, std::shared_ptr<const HuffmanDecoder>, HuffmanTableHash>
+            decoders_;
+};
 
-    Image image_;
+/* Guards against hostile files, 0 means no limit. Sizes are checked against SOF0 before
+ * anything is allocated for the frame, time is checked once per MCU row and marker segment. */
+struct DecodeLimits {
+    size_t max_pixels = 0;
+    /* Bytes of coefficients, samples and the output image */
+    size_t max_memory = 0;
+    size_t max_scans = 0;
+    std::chrono::nanoseconds max_time{0};
+};
 
-    std::vector<std::vector<int>> Y_;
-    std::vector<std::vector<int>> Cb_;
-    std::vector<std::vector<int>> Cr_;
+/* Per-image memory that outlives a decode. Reuse one context per worker thread so that repeated
+ * decodes don't touch the heap once it has grown to the largest image. One decode at a time. */
+struct DecoderContext {
+    DecodeLimits limits;
+    /* Corrupt or truncated entropy-coded data doesn't fail the decode: the damaged MCUs are gray,
+     * decoding resumes at the next restart marker, and damaged is set */
+    bool tolerant = false;
+    bool damaged = false;
+    /* With more than one, IDCT and color conversion of a single-scan frame run on threads - 1
+     * workers while the calling thread is still decoding the rows below. On a single core that
+     * is slower than one thread. */
+    size_t threads = 1;
+    IDCTMode idct_mode = IDCTMode::kFloat;
+    Arena arena;
+    /* The workers, started by the first decode that needs them */
+    RowPipeline pipeline;
+    /* The file so far when decoding a stream */
+    std::vector<uint8_t> input;
+    std::vector<char> file_buffer = std::vector<char>(1 << 16);
+    std::string comment;
+    Image image;
+};
 
-    std::vector<std::vector<std::vector<int>>> quantification_tables_;
+class Decoder {
+public:
+    using Block = ::Block;
 
     struct Component {
-        Component(size_t id, size_t hth, size_t vth, size_t qt_id)
-                : id(id), hth(hth), vth(vth), qt_id(qt_id) {}
+        Component(size_t id, size_t hth, size_t vth, size_t qt_id, Arena* arena = nullptr)
+                : id(id), hth(hth), vth(vth), qt_id(qt_id), blocks(arena), samples(arena) {}
 
         size_t id;
         size_t hth;
@@ -487,7 +937,16 @@ private:
         size_t qt_id;
 
         int last_DC = 0;
-        std::vector<HuffmanTree> trees;
+        std::array<std::shared_ptr<const HuffmanDecoder>, 2> decoders;
+        StandardTables standard_tables = StandardTables::kNone;
+
+        /* Quantized coefficients, blocks_h x blocks_v blocks padded up to whole MCUs */
+        size_t blocks_h = 0;
+        size_t blocks_v = 0;
+        ArenaVector<Block> blocks;
+
+        /* Samples after IDCT, blocks_h * BLOCK_SIZE wide */
+        ArenaVector<uint8_t> samples;
 
         friend bool operator==(const Component& lhs, const Component& rhs) {
             return lhs.id == rhs.id && lhs.hth == rhs.hth
@@ -495,152 +954,1560 @@ private:
         }
     };
 
-    // SOF0
-    size_t precision_;
-    size_t numer_of_components_;
-    std::vector<Component> components_;
+    struct ScanComponent {
+        size_t component;
+        size_t DC_table_id;
+        size_t AC_table_id;
+    };
 
-    size_t hth_max = 0;
-    size_t vth_max = 0;
+    struct Scan {
+        explicit Scan(ArenaAllocator<ScanComponent> allocator = {}) : components(allocator) {}
+
+        ArenaVector<ScanComponent> components;
+        size_t mcus_h = 0;
+        size_t mcus_v = 0;
+    };
+
+    /* Where Resume stopped */
+    enum class Progress {
+        kDone,
+        kNeedInput,
+        kYield
+    };
+
+    Decoder(File&& file)
+            : Decoder(std::move(file), nullptr) {}
+
+    /* Resets the context arena, everything decoded before with this context is gone */
+    Decoder(File&& file, DecoderContext* context, DecodeStats* stats = nullptr)
+            : own_context_(context ? nullptr : std::make_unique<DecoderContext>())
+            , context_(context ? context : own_context_.get())
+            , stats_(stats)
+            , limits_(context_->limits)
+            , file_(std::move(file))
+            , bit_reader_(&file_)
+            , image_(context_->image)
+            , components_(&context_->arena)
+            , scan_(&context_->arena)
+            , scans_(&context_->arena)
+            , color_rows_(&context_->arena)
+            , checkpoint_bits_(&file_)
+            , pipeline_rows_(&context_->arena)
+            , pipeline_stats_(&context_->arena) {
+        context_->arena.Reset();
+        context_->damaged = false;
+        image_.SetComment(std::string());
+        if (limits_.max_time.count()) {
+            deadline_ = DecodeStats::Clock::now() + limits_.max_time;
+        }
+    }
+
+    /* Streaming: the file is appended to with AppendInput, Resume returns kNeedInput when the
+     * bytes so far run out and picks up from there once there are more */
+    explicit Decoder(DecoderContext* context, DecodeStats* stats = nullptr)
+            : Decoder(File(nullptr, 0), context, stats) {
+        streaming_ = true;
+        context_->input.clear();
+    }
+
+    /* Records a checkpoint every rows MCU rows of a single-scan frame while decoding */
+    void BuildIndex(EntropyIndex* index, size_t rows) {
+        if (!rows) {
+            throw std::runtime_error("Bad index interval");
+        }
+        index_ = index;
+        index_->rows = rows;
+        index_->checkpoints.clear();
+    }
+
+    /* BuildIndex from the restart markers alone, no block is decoded and no image written */
+    void BuildIndexFromRestartMarkers(EntropyIndex* index, size_t rows) {
+        BuildIndex(index, rows);
+        SetValidateOnly();
+        index_from_markers_ = true;
+    }
 
-    std::vector<std::vector<std::vector<std::list<uint8_t>>>> tables_;
-    std::vector<std::vector<HuffmanTree>> trees_;
-
-    void FillQTWith(std::vector<std::vector<int>>& quantification_table,
-                    File& file, std::function<uint8_t(File&)>&& func,
-                    size_t size) {
-        quantification_table.resize(size, std::vector<int>(size));
-        for (size_t j = 0; j < size; ++j) {
-            for (size_t i = 0; i <= j; ++i) {
-                if (j % 2) {
-                    quantification_table[i][j - i] = func(file);
-                } else {
-                    quantification_table[j-i][i] = func(file);
+    /* Decodes pixel rows [y, y + height) only, from the closest checkpoint above them. The image
+     * is of those rows and the file is not read past them. */
+    void SetBand(const EntropyIndex& index, size_t y, size_t height) {
+        band_index_ = &index;
+        band_y_ = y;
+        band_height_ = height;
+    }
+
+    /* The coefficients of the whole frame stay in GetComponents after Parse and no image is
+     * written, otherwise a single-scan frame keeps only those of the MCU row it is decoding */
+    void KeepCoefficients() {
+        keep_coefficients_ = true;
+    }
+
+    /* Entropy decoding only, blocks are decoded into a scratch one and no image is written */
+    void SetValidateOnly() {
+        validate_only_ = true;
+        tolerant_ = false;
+    }
+
+    /* Offset of the byte where entropy decoding failed, or where parsing stopped */
+    size_t ErrorOffset() {
+        return error_ != DecodeError::kNone ? error_offset_ : file_.Position();
+    }
+
+    using RowSink = std::function<void(size_t y, const RGB* row)>;
+
+    /* Hands every row of the image to sink, top to bottom, as soon as its MCU row is decoded.
+     * Coefficients, samples and the image then take one MCU row whatever the height, the image
+     * is left holding the last one. Single-scan frames only. */
+    void SetRowSink(RowSink sink) {
+        row_sink_ = std::move(sink);
+    }
+
+    /* The bit reader points into the decoder */
+    Decoder(const Decoder&) = delete;
+    Decoder(Decoder&&) = delete;
+
+    void Parse() {
+        auto error = TryParse();
+        if (error != DecodeError::kNone) {
+            throw DecodeException(error);
+        }
+    }
+
+    /* Errors in entropy-coded data are returned, anything else throws */
+    DecodeError TryParse() {
+        Resume();
+        return error_;
+    }
+
+    DecodeError Error() const {
+        return error_;
+    }
+
+    /* Decodes as far as the input goes, returning kYield after max_rows MCU rows of entropy
+     * decoding or output, so a huge image can be decoded a slice at a time. Errors are as with
+     * TryParse once kDone is returned. */
+    Progress Resume(size_t max_rows = SIZE_MAX) {
+        size_t rows = max_rows;
+        while (true) {
+            switch (state_) {
+                case State::kStart:
+                    if (!Available(2)) {
+                        return Progress::kNeedInput;
+                    }
+                    start_ = DecodeStats::Clock::now();
+                    allocations_ = context_->arena.HeapAllocations();
+                    SOI();
+                    state_ = State::kMarkers;
+                    break;
+                case State::kMarkers:
+                    if (!ParseSegment()) {
+                        return Progress::kNeedInput;
+                    }
+                    break;
+                case State::kScan: {
+                    auto progress = stats_ ? ContinueScan<true>(&rows) : ContinueScan<false>(&rows);
+                    if (progress != Progress::kDone) {
+                        return progress;
+                    }
+                    EndScan();
+                    if (error_ != DecodeError::kNone) {
+                        state_ = State::kDone;
+                        return Progress::kDone;
+                    }
+                    if (band_index_) {
+                        BeginOutput();
+                    } else {
+                        state_ = State::kMarkers;
+                    }
+                    break;
                 }
+                case State::kOutput: {
+                    auto progress = stats_ ? WriteRows<true>(&rows) : WriteRows<false>(&rows);
+                    if (progress != Progress::kDone) {
+                        return progress;
+                    }
+                    Finish();
+                    state_ = State::kDone;
+                    break;
+                }
+                case State::kDone:
+                    return Progress::kDone;
             }
         }
+    }
 
-        bool is_odd = size % 2;
+    void AppendInput(const uint8_t* data, size_t size) {
+        if (!streaming_ || input_complete_) {
+            throw std::runtime_error("Input can't be appended");
+        }
+        auto& input = context_->input;
+        input.insert(input.end(), data, data + size);
+        file_.Rebind(input.data(), input.size());
+        bit_reader_.MoreInput();
+    }
 
-        for (size_t j = 1; j < size; ++j) {
-            for (size_t i = size - 1; i >= j; --i) {
-                if ((j + is_odd) % 2) {
-                    quantification_table[i][j + size - 1 - i] = func(file);
-                } else {
-                    quantification_table[j + size - 1 - i][i] = func(file);
-                }
+    /* The file is complete, running out of bytes is an error from now on */
+    void EndInput() {
+        input_complete_ = true;
+    }
+
+    /* Returns false if the next marker segment isn't all there yet */
+    bool ParseSegment() {
+        CheckDeadline();
+        if (tolerant_ && !scans_.empty()) {
+            /* The end of a stream isn't known before the whole file is */
+            if (!InputComplete()) {
+                return false;
             }
+            if (SkipToMarker(true) < 0) {
+                /* Truncated, what wasn't decoded stays gray */
+                context_->damaged = true;
+                BeginOutput();
+                return true;
+            }
+        }
+        if (!SegmentAvailable()) {
+            return false;
+        }
+        auto marker = file_.PeekWord();
+        if (marker >= 0xFFE0 && marker <= 0xFFEF) {
+            SkipSegment();
+            return true;
+        }
+        switch (marker) {
+            case 0xFFFE:
+                COM();
+                break;
+            case 0xFFDB:
+                DQT();
+                break;
+            case 0xFFC0:
+                SOF0();
+                break;
+            case 0xFFC4:
+                DHT();
+                break;
+            case 0xFFDD:
+                DRI();
+                break;
+            case 0xFFDA:
+                StartScan();
+                state_ = State::kScan;
+                break;
+            case 0xFFD9:
+                EOI();
+                BeginOutput();
+                break;
+            default:
+                throw std::runtime_error("Unsupported marker");
+        }
+        return true;
+    }
+
+    void Finish() {
+        if (!stats_) {
+            return;
+        }
+        stats_->bytes = file_.Position();
+        stats_->allocations = context_->arena.HeapAllocations() - allocations_;
+        /* What the other stages didn't take, workers' time may add up to more */
+        auto others = stats_->TotalNanoseconds();
+        stats_->AddTime(DecodeStats::kMarkers, start_);
+        auto& markers = stats_->nanoseconds[DecodeStats::kMarkers];
+        markers = markers > others ? markers - others : 0;
+    }
+
+    void SOI() {
+        AssertNextWord(0xFFD8, "Expected SOI");
+    }
+
+    void APP0() {
+        AssertNextWord(0xFFE0, "Expected APP0");
+        GetCurrStructureLen();
+        for (auto i = 0; i < curr_struct_len; ++i) {
+            file_.GetByte();
         }
     }
 
-    void ReadDC(std::vector<std::vector<int>>& block, size_t component_id) {
-        size_t coef_size = components_[component_id].trees[DC].DecodeNext(&file_);
-        if (coef_size == 0) {
-            block[0][0] = 0;
+    void SkipSegment() {
+        file_.GetWord();
+        GetCurrStructureLen();
+        for (size_t i = 0; i < curr_struct_len; ++i) {
+            file_.GetByte();
+        }
+    }
+
+    void COM() {
+        AssertNextWord(0xFFFE, "Expected COM");
+        GetCurrStructureLen();
+        file_.ReadString(curr_struct_len, &context_->comment);
+        image_.SetComment(context_->comment);
+    }
+
+    void DQT() {
+        AssertNextWord(0xFFDB, "Expected DQT");
+        GetCurrStructureLen();
+
+        size_t remaining = curr_struct_len;
+        while (remaining) {
+            auto precision = file_.GetHalfByte();
+            AssertBit(precision);
+            bool is_one_byte_sized = !precision;
+            auto id = file_.GetHalfByte();
+            AssertBit(id);
+
+            size_t size = 1 + BLOCK_SIZE * BLOCK_SIZE * (is_one_byte_sized ? 1 : 2);
+            if (size > remaining) {
+                throw std::runtime_error("Incorrect size of QT");
+            }
+            remaining -= size;
+
+            if (is_one_byte_sized) {
+                FillQTWith(quantification_tables_[id], file_, &File::GetByte);
+            } else {
+                FillQTWith(quantification_tables_[id], file_, &File::GetWord);
+            }
+            idct_tables_[id] = IDCTTable(context_->idct_mode, quantification_tables_[id]);
+        }
+    }
+
+    void SOF0() {
+        AssertNextWord(0xFFC0, "Expected SOF0");
+        GetCurrStructureLen();
+
+        if (!components_.empty()) {
+            throw std::runtime_error("Only one frame can be supported");
+        }
+
+        precision_ = file_.GetByte();
+        if (precision_ != 8) {
+            throw std::runtime_error("Only 8-bit precision is supported");
+        }
+        size_t height_ = file_.GetWord();
+        size_t width_ = file_.GetWord();
+        if (!height_ || !width_) {
+            throw std::runtime_error("Bad image size");
+        }
+        numer_of_components_ = file_.GetByte();
+        if (numer_of_components_ != 1 && numer_of_components_ != 3) {
+            throw std::runtime_error("Only 1 or 3 components can be supported");
+        }
+        if (curr_struct_len != 6 + 3 * numer_of_components_) {
+            throw std::runtime_error("Incorrect size of SOF0");
+        }
+
+        if (limits_.max_pixels && width_ * height_ > limits_.max_pixels) {
+            throw DecodeException(DecodeError::kLimitExceeded, "Image has too many pixels");
+        }
+
+        components_.reserve(numer_of_components_);
+        for (size_t i = 0; i < numer_of_components_; ++i) {
+            size_t id = file_.GetByte();
+            size_t hth = file_.GetHalfByte();
+            size_t vth = file_.GetHalfByte();
+            size_t qt_id = file_.GetByte();
+            if (hth == 0 || hth > 4 || vth == 0 || vth > 4) {
+                throw std::runtime_error("Bad thinning factor");
+            }
+            AssertBit(qt_id);
+            components_.emplace_back(id, hth, vth, qt_id, &context_->arena);
+            hth_max = std::max(hth_max, components_.back().hth);
+            vth_max = std::max(vth_max, components_.back().vth);
+        }
+
+        auto mcus_h = GetNumberOfComponentsByOneDimension(width_, hth_max);
+        auto mcus_v = GetNumberOfComponentsByOneDimension(height_, vth_max);
+        frame_height_ = height_;
+        last_row_ = mcus_v;
+        size_t image_height = height_;
+        if (band_index_) {
+            StartBand(width_, height_, mcus_v);
+            image_height = band_height_;
+        }
+        stored_rows_ = last_row_ - first_row_;
+        if (row_sink_ && band_index_) {
+            throw std::runtime_error("Bands can't be decoded row by row");
+        }
+        if (row_sink_) {
+            row_by_row_ = true;
+            stored_rows_ = 1;
+            image_height = std::min(height_, vth_max * BLOCK_SIZE);
+        }
+        if (validate_only_) {
+            stored_rows_ = 0;
+        }
+        if (validate_only_ || keep_coefficients_) {
+            image_height = 0;
+        }
+        frame_width_ = width_;
+        if (index_) {
+            index_->width = width_;
+            index_->height = height_;
+        }
+        if (limits_.max_memory
+            && FrameMemory(width_, image_height, mcus_h, stored_rows_)
+               > limits_.max_memory) {
+            throw DecodeException(DecodeError::kLimitExceeded, "Image needs too much memory");
+        }
+
+        if (!validate_only_) {
+            image_.SetSize(width_, image_height);
+        }
+        for (auto&& component : components_) {
+            component.blocks_h = mcus_h * component.hth;
+            component.blocks_v = mcus_v * component.vth;
+        }
+        layout_ = LayoutOf(components_);
+    }
+
+    void DHT() {
+        AssertNextWord(0xFFC4, "Expected DHT");
+        GetCurrStructureLen();
+
+        size_t remaining = curr_struct_len;
+        while (remaining) {
+            bool is_AC = file_.GetHalfByte();
+            AssertBit(is_AC);
+            TableType type = (is_AC) ? AC : DC;
+
+            size_t table_id = file_.GetHalfByte();
+            if (table_id > 1) {
+                throw std::runtime_error("Bad table id");
+            }
+
+            auto& table = tables_[type][table_id];
+            size_t size = 17;
+            for (size_t i = 0; i < 16; ++i) {
+                table.counts[i] = file_.GetByte();
+                size += table.counts[i];
+            }
+            if (size > remaining || size - 17 > table.values.size()) {
+                throw std::runtime_error("Incorrect size of DHT");
+            }
+            remaining -= size;
+
+            for (size_t i = 0; i < size - 17; ++i) {
+                table.values[i] = file_.GetByte();
+            }
+
+            SetHuffmanDecoder(type, table_id);
+        }
+    }
+
+    void DRI() {
+        AssertNextWord(0xFFDD, "Expected DRI");
+        GetCurrStructureLen();
+        if (curr_struct_len != 2) {
+            throw std::runtime_error("Incorrect size of DRI");
+        }
+        restart_interval_ = file_.GetWord();
+    }
+
+    void SOS() {
+        StartScan();
+        size_t rows = SIZE_MAX;
+        if (stats_) {
+            ContinueScan<true>(&rows);
         } else {
-            int coef;
-            if (coef_size != 255) {
-                ASSERT(coef_size < sizeof(int) * 8, "Unexpected size of coefficient");
-                coef = GetCoef(coef_size);
+            ContinueScan<false>(&rows);
+        }
+        EndScan();
+    }
+
+    /* The header of SOS, its entropy-coded data is decoded by ContinueScan */
+    void StartScan() {
+        AssertNextWord(0xFFDA, "Expected Start of Scan");
+        GetCurrStructureLen();
+
+        if (components_.empty()) {
+            throw std::runtime_error("Expected SOF0 before SOS");
+        }
+        if (limits_.max_scans && scans_.size() >= limits_.max_scans) {
+            throw DecodeException(DecodeError::kLimitExceeded, "Too many scans");
+        }
+
+        size_t number_of_scan_components = file_.GetByte();
+        if (number_of_scan_components == 0 || number_of_scan_components > components_.size()) {
+            throw std::runtime_error("Wrong number of components in scan");
+        }
+        if (curr_struct_len != 4 + 2 * number_of_scan_components) {
+            throw std::runtime_error("Incorrect size of SOS");
+        }
+
+        auto& scan = scan_;
+        scan.components.clear();
+        scan.components.reserve(number_of_scan_components);
+        for (size_t i = 0; i < number_of_scan_components; ++i) {
+            size_t component_id = file_.GetByte();
+            auto component = std::find_if(components_.begin(), components_.end(),
+                                          [&](const Component& c) { return c.id == component_id; });
+            if (component == components_.end()) {
+                throw std::runtime_error("Wrong component id");
+            }
+            size_t index = component - components_.begin();
+            for (auto&& other : scan.components) {
+                if (other.component == index) {
+                    throw std::runtime_error("Same components are detected");
+                }
+            }
+
+            auto DC_table_id = file_.GetHalfByte();
+            AssertBit(DC_table_id);
+            auto AC_table_id = file_.GetHalfByte();
+            AssertBit(AC_table_id);
+            if (!decoders_[DC][DC_table_id] || !decoders_[AC][AC_table_id]) {
+                throw std::runtime_error("Huffman table is not defined");
+            }
+            component->decoders = {decoders_[DC][DC_table_id], decoders_[AC][AC_table_id]};
+            component->standard_tables =
+                    standard_tables_[DC][DC_table_id] == standard_tables_[AC][AC_table_id]
+                    ? standard_tables_[DC][DC_table_id] : StandardTables::kNone;
+            component->last_DC = 0;
+            scan.components.push_back({index, DC_table_id, AC_table_id});
+        }
+
+        AssertNextByte(0x00, "Expected spectral selection start 0");
+        AssertNextByte(0x3F, "Expected spectral selection end 63");
+        AssertNextByte(0x00, "Expected no successive approximation");
+
+        ComputeScanSize(&scan);
+        mcu_ = 0;
+        restarts_ = 0;
+
+        /* Baseline codes every component in one scan, so such a scan completes its rows */
+        bool single_scan = scans_.empty() && scan.components.size() == components_.size();
+        if ((index_ || band_index_) && !single_scan) {
+            throw std::runtime_error("Only single-scan frames can be indexed");
+        }
+        if (row_sink_ && !single_scan) {
+            throw std::runtime_error("Only single-scan frames can be decoded row by row");
+        }
+        if (band_index_) {
+            EnterCheckpoint();
+        }
+        if (index_from_markers_) {
+            IndexRestartMarkers(scan);
+        }
+        image_written_ = false;
+        if (scans_.empty()) {
+            AllocateBlocks(single_scan);
+        }
+        if (row_by_row_) {
+            AllocateSamples();
+            color_rows_.resize(image_.Width() * components_.size());
+        } else if (context_->threads > 1 && StoresFewRows(single_scan)) {
+            StartPipeline();
+        }
+    }
+
+    /* A single-scan frame keeps a few MCU rows unless something needs more of it at once: the
+     * coefficients or a band, which keeps its own rows */
+    bool StoresFewRows(bool single_scan) const {
+        return single_scan && !band_index_ && !validate_only_ && !keep_coefficients_;
+    }
+
+    /* Two MCU rows of the ring for every thread, rounded up to a power of two for the mask */
+    static constexpr size_t kPipelineRowsPerThread = 2;
+
+    /* One thread decodes and outputs one row at a time. Workers share a ring of rows with the
+     * entropy decoder, which waits for a slot when it gets that far ahead. Sampling factors of 3
+     * keep the whole frame, the ring would not map block rows of a single component to slots. */
+    void AllocateBlocks(bool single_scan) {
+        if (StoresFewRows(single_scan) && context_->threads <= 1) {
+            row_by_row_ = true;
+            stored_rows_ = 1;
+        } else if (StoresFewRows(single_scan)) {
+            size_t ring = 1;
+            while (ring < kPipelineRowsPerThread * context_->threads) {
+                ring *= 2;
+            }
+            bool maskable = std::all_of(components_.begin(), components_.end(),
+                                        [](const Component& component) {
+                return !(component.vth & (component.vth - 1));
+            });
+            if (ring < stored_rows_ && maskable) {
+                stored_rows_ = ring;
+                row_mask_ = ring - 1;
+            }
+        }
+        for (auto&& component : components_) {
+            component.blocks.assign(component.blocks_h * StoredBlockRows(component), Block{});
+        }
+    }
+
+    void EndScan() {
+        if (validate_only_ || keep_coefficients_) {
+            image_written_ = true;
+        }
+        if (row_by_row_ && error_ == DecodeError::kNone) {
+            if (stats_) {
+                FlushRows<true>(last_row_);
             } else {
-                coef = 255;
+                FlushRows<false>(last_row_);
             }
-            coef += components_[component_id].last_DC;
-            block[0][0] = coef;
-            components_[component_id].last_DC = coef;
+            image_written_ = true;
+        }
+        bit_reader_.Reset();
+        if (stats_) {
+            stats_->restarts += restarts_;
+        }
+        if (pipeline_) {
+            FinishPipeline();
         }
+        scans_.push_back(scan_);
     }
 
-    void ReadAC(std::vector<std::vector<int>>& block, size_t component_id) {
-        assert(block.size());
-        size_t number_of_zeros = 0;
-        size_t coef_size = 0;
-        bool was_continued = false;
-        int coef;
-        for (size_t j = 0; j < block.size(); ++j) {
-            for (size_t i = 0; i <= j; ++i) {
-                if (!i && !j) {
-                    continue;
+    /* Stops before an MCU row when rows have been decoded, or when a stream runs out of bytes in
+     * the middle of an MCU, which is then decoded again from its start */
+    template <bool kStats>
+    Progress ContinueScan(size_t* rows) {
+        switch (layout_) {
+            case Layout::k1x1:
+                return ContinueScanWith<kStats, 1, 1>(rows);
+            case Layout::k2x1:
+                return ContinueScanWith<kStats, 2, 1>(rows);
+            case Layout::k2x2:
+                return ContinueScanWith<kStats, 2, 2>(rows);
+            case Layout::k4x1:
+                return ContinueScanWith<kStats, 4, 1>(rows);
+            default:
+                return ContinueScanWith<kStats, 0, 0>(rows);
+        }
+    }
+
+    /* kH x kV is the luma sampling of the layout, 0 x 0 for the generic loop */
+    template <bool kStats, size_t kH, size_t kV>
+    Progress ContinueScanWith(size_t* rows) {
+        auto start = DecodeStats::Clock::now();
+        auto& scan = scan_;
+        auto progress = Progress::kDone;
+        size_t scan_rows_per_row = ScanRowsPerRow(scan);
+        size_t row_mcus = scan_rows_per_row * scan.mcus_h;
+        size_t mcus = std::min(scan.mcus_h * scan.mcus_v, last_row_ * row_mcus);
+        while (mcu_ < mcus) {
+            if (row_by_row_ && mcu_ >= (first_row_ + 1) * row_mcus) {
+                auto flush_start = DecodeStats::Clock::now();
+                FlushRows<kStats>(mcu_ / row_mcus);
+                start += DecodeStats::Clock::now() - flush_start;
+            }
+            if (pipeline_ && mcu_ >= (pipeline_row_ + 1) * row_mcus) {
+                /* Waits for a slot of the ring */
+                auto publish_start = DecodeStats::Clock::now();
+                pipeline_row_ = mcu_ / row_mcus;
+                pipeline_->Publish(pipeline_row_);
+                start += DecodeStats::Clock::now() - publish_start;
+            }
+            if (mcu_ % scan.mcus_h == 0) {
+                if (!*rows) {
+                    progress = Progress::kYield;
+                    break;
+                }
+                --*rows;
+                CheckDeadline();
+                size_t row = mcu_ / scan.mcus_h / scan_rows_per_row;
+                if (index_ && mcu_ % row_mcus == 0
+                    && row % index_->rows == 0) {
+                    AddCheckpoint(row);
                 }
+            }
+            if (!InputComplete()) {
+                SaveCheckpoint();
+            }
+            if (restart_interval_ && mcu_ && mcu_ % restart_interval_ == 0) {
+                ReadRestartMarker(scan, restarts_++);
+            }
+            ForEachBlockOfMCUWith<kH, kV>(scan, mcu_ / scan.mcus_h, mcu_ % scan.mcus_h,
+                                          [&](size_t component, size_t block) {
+                auto& target = validate_only_ ? scratch_block_ : components_[component].blocks[block];
+                auto eob = ReadBlock(target, component);
+                if constexpr (kStats) {
+                    ++stats_->blocks;
+                    ++stats_->eob_histogram[eob];
+                }
+            });
+            if (bit_reader_.Error() == DecodeError::kNone) {
+                ++mcu_;
+            } else if (!InputComplete()) {
+                /* Whatever the error, it may be the missing bytes */
+                RestoreCheckpoint();
+                progress = Progress::kNeedInput;
+                break;
+            } else if (tolerant_) {
+                mcu_ = Resync(scan, mcu_, &restarts_);
+            } else {
+                error_ = bit_reader_.Error();
+                error_offset_ = bit_reader_.ErrorOffset();
+                break;
+            }
+        }
+        if constexpr (kStats) {
+            stats_->AddTime(DecodeStats::kEntropy, start);
+        }
+        return progress;
+    }
+
+    void EOI() {
+        AssertNextWord(0xFFD9, "Expected End of Image");
+    }
+
+    void BeginOutput() {
+        if (scans_.empty()) {
+            throw std::runtime_error("Expected SOS before EOI");
+        }
+        state_ = State::kOutput;
+        if (image_written_) {
+            output_row_ = last_row_;
+            return;
+        }
+        AllocateSamples();
+        color_rows_.resize(image_.Width() * components_.size());
+        output_row_ = first_row_;
+    }
+
+    /* IDCT and color conversion of the MCU rows not written yet, rows at most */
+    template <bool kStats>
+    Progress WriteRows(size_t* rows) {
+        for (; output_row_ < last_row_; ++output_row_) {
+            if (!*rows) {
+                return Progress::kYield;
+            }
+            --*rows;
+            CheckDeadline();
+            auto start = DecodeStats::Clock::now();
+            TransformMCURow<kStats>(output_row_, stats_);
+            if constexpr (kStats) {
+                stats_->AddTime(DecodeStats::kIDCT, start);
+                start = DecodeStats::Clock::now();
+            }
+            ColorMCURow(output_row_, color_rows_.data());
+            if constexpr (kStats) {
+                stats_->AddTime(DecodeStats::kColor, start);
+            }
+        }
+        image_written_ = true;
+        return Progress::kDone;
+    }
+
+    size_t MCURows() const {
+        return components_[0].blocks_v / components_[0].vth;
+    }
+
+    void AllocateSamples() {
+        for (auto&& component : components_) {
+            component.samples.resize(component.blocks_h * StoredBlockRows(component)
+                                     * BLOCK_SIZE * BLOCK_SIZE);
+        }
+    }
 
-                if (!was_continued) {
-                    int8_t byte = components_[component_id].trees[AC].DecodeNext(&file_);
-                    if (!byte) {
-                        return;
+    /* Dequantized and transformed blocks of one MCU row into the samples of every component */
+    template <bool kStats>
+    void TransformMCURow(size_t mcu_y, DecodeStats* stats) {
+        auto inverse_dct_row = kernels_.inverse_dct_row[static_cast<size_t>(context_->idct_mode)];
+        for (auto&& component : components_) {
+            size_t stride = component.blocks_h * BLOCK_SIZE;
+            size_t begin = StoredRow(mcu_y) * component.vth;
+            for (size_t i = begin; i < begin + component.vth; ++i) {
+                auto blocks = &component.blocks[i * component.blocks_h];
+                if constexpr (kStats) {
+                    for (size_t j = 0; j < component.blocks_h; ++j) {
+                        stats->dc_only_blocks += IsDCOnly(blocks[j]);
                     }
-                    number_of_zeros = (byte & 0b11110000) >> 4;
-                    coef_size = byte & 0b00001111;
-                    coef = GetCoef(coef_size);
                 }
+                inverse_dct_row(blocks, component.blocks_h,
+                                idct_tables_[component.qt_id],
+                                &component.samples[i * stride * BLOCK_SIZE], stride);
+            }
+        }
+    }
+
+    /* Image rows of one MCU row from the samples, rows holds a row of every component */
+    void ColorMCURow(size_t mcu_y, uint8_t* rows) {
+        switch (layout_) {
+            case Layout::k1x1:
+                return ColorMCURowWith<1, 1>(mcu_y, rows);
+            case Layout::k2x1:
+                return ColorMCURowWith<2, 1>(mcu_y, rows);
+            case Layout::k2x2:
+                return ColorMCURowWith<2, 2>(mcu_y, rows);
+            case Layout::k4x1:
+                return ColorMCURowWith<4, 1>(mcu_y, rows);
+            default:
+                return ColorMCURowWith<0, 0>(mcu_y, rows);
+        }
+    }
 
-                if (number_of_zeros > 0) {
-                    --number_of_zeros;
-                    was_continued = true;
-                    continue;
+    /* A layout converts luma samples where they are and upsamples chroma by a known factor, the
+     * generic loop copies every component into rows first */
+    template <size_t kH, size_t kV>
+    void ColorMCURowWith(size_t mcu_y, uint8_t* rows) {
+        size_t width = image_.Width();
+        size_t begin = std::max(image_top_, mcu_y * vth_max * BLOCK_SIZE);
+        size_t end = std::min({image_top_ + image_.Height(), (mcu_y + 1) * vth_max * BLOCK_SIZE,
+                               frame_height_});
+        /* Pixel row y is row y - top of the stored MCU row */
+        size_t top = mcu_y * vth_max * BLOCK_SIZE;
+        size_t stored = StoredRow(mcu_y);
+        for (size_t y = begin; y < end; ++y) {
+            auto output = image_.GetRow(y - image_top_);
+            if constexpr (kH != 0) {
+                size_t luma_row = stored * kV * BLOCK_SIZE + y - top;
+                size_t chroma_row = stored * BLOCK_SIZE + (y - top) / kV;
+                const uint8_t* chroma[2];
+                for (size_t c = 1; c < 3; ++c) {
+                    size_t stride = components_[c].blocks_h * BLOCK_SIZE;
+                    auto samples = &components_[c].samples[chroma_row * stride];
+                    chroma[c - 1] = kH == 1 ? samples : &rows[c * width];
+                    if constexpr (kH == 2) {
+                        kernels_.upsample_row(samples, 1, 2, width, &rows[c * width]);
+                    } else if constexpr (kH > 2) {
+                        UpsampleRowBy<kH>(samples, width, &rows[c * width]);
+                    }
                 }
+                auto& luma = components_[0];
+                kernels_.convert_row(&luma.samples[luma_row * luma.blocks_h * BLOCK_SIZE],
+                                     chroma[0], chroma[1], width, output);
+                continue;
+            }
+            for (size_t c = 0; c < components_.size(); ++c) {
+                auto& component = components_[c];
+                size_t stride = component.blocks_h * BLOCK_SIZE;
+                size_t row = stored * component.vth * BLOCK_SIZE
+                             + (y - top) * component.vth / vth_max;
+                kernels_.upsample_row(&component.samples[row * stride],
+                                      component.hth, hth_max, width, &rows[c * width]);
+            }
+            if (components_.size() == 1) {
+                ConvertGrayRow(rows, width, output);
+            } else {
+                kernels_.convert_row(rows, &rows[width], &rows[2 * width], width, output);
+            }
+        }
+    }
 
-                was_continued = false;
+    /* Row by row: outputs the MCU rows before row while their blocks and samples are still in
+     * cache, the storage is cleared for the next one. A row sink gets them from an image one MCU
+     * row high. */
+    template <bool kStats>
+    void FlushRows(size_t row) {
+        size_t row_height = vth_max * BLOCK_SIZE;
+        for (; first_row_ < row; ++first_row_) {
+            auto start = DecodeStats::Clock::now();
+            TransformMCURow<kStats>(first_row_, stats_);
+            if constexpr (kStats) {
+                stats_->AddTime(DecodeStats::kIDCT, start);
+                start = DecodeStats::Clock::now();
+            }
+            if (row_sink_) {
+                image_top_ = first_row_ * row_height;
+            }
+            ColorMCURow(first_row_, color_rows_.data());
+            if constexpr (kStats) {
+                stats_->AddTime(DecodeStats::kColor, start);
+            }
+            if (row_sink_) {
+                size_t end = std::min(frame_height_, image_top_ + row_height);
+                for (size_t y = image_top_; y < end; ++y) {
+                    row_sink_(y, image_.GetRow(y - image_top_));
+                }
+            }
+            ClearStoredRow(first_row_);
+        }
+    }
 
-                if (j % 2) {
-                    block[i][j - i] = coef;
-                } else {
-                    block[j-i][i] = coef;
+    /* Workers only touch their own rows of samples and of the image, and their own stats. In a
+     * ring a worker clears the blocks of its row, the slot is free again once it is done. */
+    void StartPipeline() {
+        AllocateSamples();
+        size_t workers = context_->threads - 1;
+        pipeline_rows_.resize(image_.Width() * components_.size() * workers);
+        if (stats_) {
+            pipeline_stats_.assign(workers, DecodeStats());
+        }
+        size_t capacity = row_mask_ != ~size_t(0) ? stored_rows_ : 0;
+        pipeline_row_ = 0;
+        /* Captures nothing but this, which std::function keeps without allocating */
+        context_->pipeline.Start(MCURows(), workers, [this](size_t mcu_y, size_t worker) {
+            bool ring = row_mask_ != ~size_t(0);
+            auto rows = &pipeline_rows_[worker * image_.Width() * components_.size()];
+            if (!stats_) {
+                TransformMCURow<false>(mcu_y, nullptr);
+                if (ring) {
+                    ClearStoredRow(mcu_y);
                 }
+                ColorMCURow(mcu_y, rows);
+                return;
+            }
+            auto& stats = pipeline_stats_[worker];
+            auto start = DecodeStats::Clock::now();
+            TransformMCURow<true>(mcu_y, &stats);
+            if (ring) {
+                ClearStoredRow(mcu_y);
+            }
+            stats.AddTime(DecodeStats::kIDCT, start);
+            start = DecodeStats::Clock::now();
+            ColorMCURow(mcu_y, rows);
+            stats.AddTime(DecodeStats::kColor, start);
+        }, capacity);
+        pipeline_.reset(&context_->pipeline);
+    }
+
+    void FinishPipeline() {
+        if (error_ == DecodeError::kNone) {
+            pipeline_->Finish();
+            image_written_ = true;
+        }
+        /* Aborts the workers after an error */
+        pipeline_.reset();
+        if (stats_) {
+            for (auto&& stats : pipeline_stats_) {
+                stats_->dc_only_blocks += stats.dc_only_blocks;
+                stats_->nanoseconds[DecodeStats::kIDCT] += stats.nanoseconds[DecodeStats::kIDCT];
+                stats_->nanoseconds[DecodeStats::kColor] += stats.nanoseconds[DecodeStats::kColor];
             }
         }
+    }
 
-        bool is_odd = block.size() % 2;
+    /* Odd number of components may emerge while thinning */
+    void ComputeScanSize(Scan* scan) const {
+        if (scan->components.size() == 1) {
+            auto& component = components_[scan->components[0].component];
+            scan->mcus_h = GetNumberOfComponentsByOneDimension(
+                    frame_width_ * component.hth, hth_max);
+            scan->mcus_v = GetNumberOfComponentsByOneDimension(
+                    frame_height_ * component.vth, vth_max);
+        } else {
+            scan->mcus_h = GetNumberOfComponentsByOneDimension(frame_width_, hth_max);
+            scan->mcus_v = GetNumberOfComponentsByOneDimension(frame_height_, vth_max);
+        }
+    }
+
+    /* Calls func(component index, block index) for every block of the MCU in coding order.
+     * Blocks are stored as StoredRow places their MCU row, a scan of one component has block
+     * rows for MCU rows. */
+    template <typename Func>
+    void ForEachBlockOfMCU(const Scan& scan, size_t mcu_y, size_t mcu_x, Func&& func) const {
+        if (scan.components.size() == 1) {
+            auto index = scan.components[0].component;
+            auto& component = components_[index];
+            size_t row = (mcu_y - first_row_ * component.vth)
+                         & (row_mask_ * component.vth + component.vth - 1);
+            func(index, row * component.blocks_h + mcu_x);
+            return;
+        }
+        size_t stored = StoredRow(mcu_y);
+        for (auto&& scan_component : scan.components) {
+            auto& component = components_[scan_component.component];
+            for (size_t i = 0; i < component.vth; ++i) {
+                for (size_t j = 0; j < component.hth; ++j) {
+                    func(scan_component.component,
+                         (stored * component.vth + i) * component.blocks_h
+                         + mcu_x * component.hth + j);
+                }
+            }
+        }
+    }
 
-        for (size_t j = 1; j < block.size(); ++j) {
-            for (size_t i = block.size() - 1; i >= j; --i) {
-                if (!was_continued) {
-                    int8_t byte = components_[component_id].trees[AC].DecodeNext(&file_);
-                    if (!byte) {
-                        return;
+    /* The same for a layout: luma blocks are unrolled, chroma has one block each */
+    template <size_t kH, size_t kV, typename Func>
+    void ForEachBlockOfMCUWith(const Scan& scan, size_t mcu_y, size_t mcu_x, Func&& func) const {
+        if constexpr (kH != 0) {
+            if (scan.components.size() == 3) {
+                size_t stored = StoredRow(mcu_y);
+                for (auto&& scan_component : scan.components) {
+                    auto index = scan_component.component;
+                    size_t blocks_h = components_[index].blocks_h;
+                    if (index != 0) {
+                        func(index, stored * blocks_h + mcu_x);
+                        continue;
+                    }
+                    size_t first = stored * kV * blocks_h + mcu_x * kH;
+                    for (size_t i = 0; i < kV; ++i) {
+                        for (size_t j = 0; j < kH; ++j) {
+                            func(index, first + i * blocks_h + j);
+                        }
                     }
-                    number_of_zeros = (byte & 0b11110000) >> 4;
-                    coef_size = byte & 0b00001111;
-                    coef = GetCoef(coef_size);
                 }
+                return;
+            }
+        }
+        ForEachBlockOfMCU(scan, mcu_y, mcu_x, std::forward<Func>(func));
+    }
+
+    const Image& GetImage() const {
+        return image_;
+    }
+
+    /* The image may be a band or a row of the frame */
+    size_t GetFrameHeight() const {
+        return frame_height_;
+    }
+
+    const ArenaVector<Component>& GetComponents() const {
+        return components_;
+    }
+
+    const ArenaVector<Scan>& GetScans() const {
+        return scans_;
+    }
+
+    size_t GetRestartInterval() const {
+        return restart_interval_;
+    }
+
+    void GetCurrStructureLen() {
+        auto len = static_cast<uint16_t>(file_.GetWord());
+        if (len < 2) {
+            throw std::runtime_error("Incorrect structure length");
+        }
+        curr_struct_len = len - 2;
+    }
+
+    void AssertBit(uint val) {
+        if ((val & static_cast<uint>(-2)) != 0) {
+            throw std::runtime_error("Expected 1 or 0");
+        }
+    }
+
+    void AssertNextByte(uint8_t val, const char* error_message = "") {
+        auto byte = file_.GetByte();
+        if (byte != val) {
+            throw std::runtime_error(error_message);
+        }
+    }
+
+    void AssertNextWord(uint16_t val, const char* error_message = "") {
+        auto word = file_.GetWord();
+        if (word != val) {
+            throw std::runtime_error(error_message);
+        }
+    }
+
+    static void RunTests();
+
+private:
+    enum TableType {
+        DC = 0,
+        AC = 1
+    };
+
+    std::unique_ptr<DecoderContext> own_context_;
+    DecoderContext* context_;
+    DecodeStats* stats_;
+    const DecodeLimits& limits_;
+    DecodeStats::Clock::time_point deadline_ = DecodeStats::Clock::time_point::max();
+    const Kernels& kernels_ = GetKernels();
+
+    File file_;
+    BitReader bit_reader_;
+    size_t curr_struct_len;
+
+    Image& image_;
+
+    std::array<Block, 2> quantification_tables_{};
+    /* The same as the inverse_dct_row of the IDCT mode takes them */
+    std::array<Block, 2> idct_tables_{};
+
+    // SOF0
+    size_t precision_;
+    size_t numer_of_components_;
+    ArenaVector<Component> components_;
+
+    size_t hth_max = 0;
+    size_t vth_max = 0;
 
-                if (number_of_zeros > 0) {
-                    --number_of_zeros;
-                    was_continued = true;
-                    continue;
+    /* Luma sampling of a YCbCr frame whose chroma isn't thinned, the layouts of nearly every
+     * file. Their MCU loops have it at compile time, any other takes the generic ones. */
+    enum class Layout {
+        kGeneric,
+        k1x1,
+        k2x1,
+        k2x2,
+        k4x1
+    };
+
+    Layout layout_ = Layout::kGeneric;
+
+    static Layout LayoutOf(const ArenaVector<Component>& components) {
+        if (components.size() != 3 || components[1].hth != 1 || components[1].vth != 1
+            || components[2].hth != 1 || components[2].vth != 1) {
+            return Layout::kGeneric;
+        }
+        auto& luma = components[0];
+        if (luma.vth == 1) {
+            switch (luma.hth) {
+                case 1:
+                    return Layout::k1x1;
+                case 2:
+                    return Layout::k2x1;
+                case 4:
+                    return Layout::k4x1;
+                default:
+                    break;
+            }
+        }
+        return luma.hth == 2 && luma.vth == 2 ? Layout::k2x2 : Layout::kGeneric;
+    }
+
+    // DRI
+    size_t restart_interval_ = 0;
+
+    enum class State {
+        kStart,
+        kMarkers,
+        kScan,
+        kOutput,
+        kDone
+    };
+
+    State state_ = State::kStart;
+    DecodeStats::Clock::time_point start_;
+    size_t allocations_ = 0;
+
+    /* The scan being decoded and the next MCU of it */
+    Scan scan_;
+    size_t mcu_ = 0;
+    size_t restarts_ = 0;
+    ArenaVector<Scan> scans_;
+    /* The first error in entropy-coded data, the decode stops there */
+    DecodeError error_ = DecodeError::kNone;
+    size_t error_offset_ = 0;
+    bool tolerant_ = context_->tolerant;
+    bool validate_only_ = false;
+    bool index_from_markers_ = false;
+    bool keep_coefficients_ = false;
+    /* One MCU row is stored and output as soon as it is decoded */
+    bool row_by_row_ = false;
+    Block scratch_block_{};
+
+    std::array<std::array<HuffmanTable, 2>, 2> tables_;
+    std::array<std::array<std::shared_ptr<const HuffmanDecoder>, 2>, 2> decoders_;
+    std::array<std::array<StandardTables, 2>, 2> standard_tables_{};
+
+    bool image_written_ = false;
+    size_t output_row_ = 0;
+    /* A row of every component before color conversion */
+    ArenaVector<uint8_t> color_rows_;
+
+    /* MCU rows first_row_ to last_row_ are decoded, stored_rows_ of them at a time from
+     * first_row_ on, in a ring when row_mask_ is below them. The image starts at pixel row
+     * image_top_ of the frame. */
+    size_t first_row_ = 0;
+    size_t last_row_ = 0;
+    size_t stored_rows_ = 0;
+    size_t row_mask_ = ~size_t(0);
+    size_t image_top_ = 0;
+    size_t frame_width_ = 0;
+    size_t frame_height_ = 0;
+
+    const EntropyIndex* band_index_ = nullptr;
+    const EntropyIndex::Checkpoint* band_checkpoint_ = nullptr;
+    size_t band_y_ = 0;
+    size_t band_height_ = 0;
+    RowSink row_sink_;
+    EntropyIndex* index_ = nullptr;
+
+    bool streaming_ = false;
+    bool input_complete_ = false;
+    /* Streaming: the state before the MCU being decoded */
+    size_t checkpoint_position_ = 0;
+    BitReader checkpoint_bits_;
+    size_t checkpoint_restarts_ = 0;
+    std::array<int, 3> checkpoint_DC_{};
+
+    ArenaVector<uint8_t> pipeline_rows_;
+    ArenaVector<DecodeStats> pipeline_stats_;
+    /* The MCU row the entropy decoder may write */
+    size_t pipeline_row_ = 0;
+    /* The pipeline of the context while it runs rows of this decoder. Last, so that the run is
+     * aborted before anything its workers use is destroyed. */
+    std::unique_ptr<RowPipeline, RowPipeline::Aborter> pipeline_;
+
+    /* Standard tables are checked first, the counts alone rule out almost any other table */
+    void SetHuffmanDecoder(TableType type, size_t table_id) {
+        using namespace standard_huffman;
+        auto& table = tables_[type][table_id];
+        auto& standard = standard_tables_[type][table_id];
+        const HuffmanDecoder* decoder = nullptr;
+        if (table == (type == DC ? kLuminanceDC : kLuminanceAC)) {
+            standard = StandardTables::kLuminance;
+            decoder = type == DC ? &kLuminanceDCDecoder : &kLuminanceACDecoder;
+        } else if (table == (type == DC ? kChrominanceDC : kChrominanceAC)) {
+            standard = StandardTables::kChrominance;
+            decoder = type == DC ? &kChrominanceDCDecoder : &kChrominanceACDecoder;
+        } else {
+            standard = StandardTables::kNone;
+            decoders_[type][table_id] = HuffmanDecoderCache::Instance().Get(table);
+            return;
+        }
+        /* Not owning, the standard decoders are static */
+        decoders_[type][table_id] = std::shared_ptr<const HuffmanDecoder>(
+                std::shared_ptr<const HuffmanDecoder>(), decoder);
+    }
+
+    bool InputComplete() const {
+        return !streaming_ || input_complete_;
+    }
+
+    bool Available(size_t size) {
+        return InputComplete() || file_.Remaining() >= size;
+    }
+
+    /* The marker at the file position and its segment */
+    bool SegmentAvailable() {
+        if (!Available(2)) {
+            return false;
+        }
+        auto marker = file_.PeekWord();
+        if (marker == 0xFFD8 || marker == 0xFFD9) {
+            return true;
+        }
+        if (!Available(4)) {
+            return false;
+        }
+        auto position = file_.Position();
+        file_.GetWord();
+        size_t length = file_.GetWord();
+        file_.Seek(position);
+        return Available(2 + length);
+    }
+
+    /* Rows of a scan of one component are block rows */
+    size_t ScanRowsPerRow(const Scan& scan) const {
+        return scan.components.size() == 1 ? components_[scan.components[0].component].vth : 1;
+    }
+
+    size_t StoredBlockRows(const Component& component) const {
+        return stored_rows_ * component.vth;
+    }
+
+    /* Where MCU row mcu_y is stored */
+    size_t StoredRow(size_t mcu_y) const {
+        return (mcu_y - first_row_) & row_mask_;
+    }
+
+    /* The blocks of a stored MCU row are zero again before the next row is decoded into them */
+    void ClearStoredRow(size_t mcu_y) {
+        for (auto&& component : components_) {
+            size_t blocks = component.vth * component.blocks_h;
+            auto first = component.blocks.begin() + StoredRow(mcu_y) * blocks;
+            std::fill(first, first + blocks, Block{});
+        }
+    }
+
+    void StartBand(size_t width, size_t height, size_t mcus_v) {
+        auto& index = *band_index_;
+        if (index.width != width || index.height != height) {
+            throw std::runtime_error("Index doesn't match the file");
+        }
+        if (!band_height_ || band_y_ >= height || band_height_ > height - band_y_) {
+            throw std::runtime_error("Band is out of the image");
+        }
+        size_t row_height = vth_max * BLOCK_SIZE;
+        band_checkpoint_ = &index.Find(band_y_ / row_height);
+        first_row_ = band_checkpoint_->mcu_row;
+        last_row_ = (band_y_ + band_height_ + row_height - 1) / row_height;
+        image_top_ = band_y_;
+        if (last_row_ > mcus_v) {
+            throw std::runtime_error("Index doesn't match the file");
+        }
+    }
+
+    void EnterCheckpoint() {
+        auto& checkpoint = *band_checkpoint_;
+        bit_reader_.Seek(checkpoint.offset, checkpoint.bit);
+        mcu_ = checkpoint.mcu_row * ScanRowsPerRow(scan_) * scan_.mcus_h;
+        restarts_ = checkpoint.restarts;
+        for (size_t i = 0; i < components_.size(); ++i) {
+            components_[i].last_DC = checkpoint.last_DC[i];
+        }
+    }
+
+    /* Checkpoints at the markers that start the indexed rows, with nothing to carry over from
+     * the rows above but the restarts. The scan is left done at the marker after it. */
+    void IndexRestartMarkers(const Scan& scan) {
+        size_t row_mcus = ScanRowsPerRow(scan) * scan.mcus_h;
+        size_t mcus = scan.mcus_h * scan.mcus_v;
+        if (!restart_interval_ || index_->rows * row_mcus % restart_interval_) {
+            throw std::runtime_error("Restart intervals don't start the indexed rows");
+        }
+        size_t start = file_.Position();
+        std::vector<size_t> markers;
+        while (true) {
+            auto window = file_.Window();
+            size_t skip = kernels_.find_marker_byte(window.first, window.second);
+            file_.Advance(skip);
+            if (skip == window.second) {
+                if (!skip) {
+                    break;
                 }
+                continue;
+            }
+            /* The marker may straddle the window */
+            auto position = file_.Position();
+            file_.GetByte();
+            int next = file_.PeekByte();
+            if (next == 0x00) {
+                file_.GetByte();
+            } else if (next == static_cast<int>(0xD0 + markers.size() % 8)) {
+                markers.push_back(position);
+                file_.GetByte();
+            } else if (next != 0xFF) {
+                file_.Seek(position);
+                break;
+            }
+        }
+        if (markers.size() != (mcus - 1) / restart_interval_) {
+            throw DecodeException(DecodeError::kBadRestartMarker, "Restart markers are missing");
+        }
+        for (size_t row = 0; row * row_mcus < mcus; row += index_->rows) {
+            size_t interval = row * row_mcus / restart_interval_;
+            auto& checkpoint = index_->checkpoints.emplace_back();
+            checkpoint.mcu_row = row;
+            checkpoint.offset = interval ? markers[interval - 1] : start;
+            checkpoint.restarts = interval ? interval - 1 : 0;
+        }
+        mcu_ = mcus;
+        restarts_ = markers.size();
+    }
+
+    /* Rows may be started more than once after a stream ran out of bytes */
+    void AddCheckpoint(size_t row) {
+        auto& checkpoints = index_->checkpoints;
+        if (!checkpoints.empty() && checkpoints.back().mcu_row >= row) {
+            return;
+        }
+        auto& checkpoint = checkpoints.emplace_back();
+        checkpoint.mcu_row = row;
+        std::tie(checkpoint.offset, checkpoint.bit) = bit_reader_.Tell();
+        checkpoint.restarts = restarts_;
+        for (size_t i = 0; i < components_.size(); ++i) {
+            checkpoint.last_DC[i] = components_[i].last_DC;
+        }
+    }
 
-                was_continued = false;
+    void SaveCheckpoint() {
+        checkpoint_position_ = file_.Position();
+        checkpoint_bits_ = bit_reader_;
+        checkpoint_restarts_ = restarts_;
+        for (size_t i = 0; i < components_.size(); ++i) {
+            checkpoint_DC_[i] = components_[i].last_DC;
+        }
+    }
+
+    /* Blocks are zeroed as well, decoding doesn't write zero coefficients */
+    void RestoreCheckpoint() {
+        ClearMCU(scan_, mcu_);
+        file_.Seek(checkpoint_position_);
+        bit_reader_ = checkpoint_bits_;
+        restarts_ = checkpoint_restarts_;
+        for (size_t i = 0; i < components_.size(); ++i) {
+            components_[i].last_DC = checkpoint_DC_[i];
+        }
+    }
+
+    void ClearMCU(const Scan& scan, size_t mcu) {
+        if (validate_only_) {
+            return;
+        }
+        ForEachBlockOfMCU(scan, mcu / scan.mcus_h, mcu % scan.mcus_h,
+                          [&](size_t component, size_t block) {
+            components_[component].blocks[block] = Block{};
+        });
+    }
+
+    void CheckDeadline() const {
+        if (DecodeStats::Clock::now() > deadline_) {
+            throw DecodeException(DecodeError::kLimitExceeded, "Decode takes too long");
+        }
+    }
+
+    /* Coefficients and samples of every component and the output image */
+    size_t FrameMemory(size_t width, size_t height, size_t mcus_h, size_t mcus_v) const {
+        size_t bytes = width * height * sizeof(RGB);
+        for (auto&& component : components_) {
+            size_t blocks = mcus_h * component.hth * mcus_v * component.vth;
+            bytes += blocks * (sizeof(Block) + BLOCK_SIZE * BLOCK_SIZE);
+        }
+        return bytes;
+    }
+
+    /* Tolerant mode: the damaged MCU and the rest of its restart interval stay gray. Returns the
+     * MCU to go on from, the file is left at its restart marker, or at the end of the scan. */
+    size_t Resync(const Scan& scan, size_t mcu, size_t* restarts) {
+        context_->damaged = true;
+        ClearMCU(scan, mcu);
+        bit_reader_.Reset();
+        size_t mcus = scan.mcus_h * scan.mcus_v;
+        while (restart_interval_) {
+            int marker = SkipToMarker(false);
+            if (marker < 0xD0 || marker > 0xD7) {
+                break;
+            }
+            /* Marker n starts the intervals 8k + n + 1. The failure may have been the marker of
+             * the interval starting at mcu. */
+            size_t interval =
+                    std::max<size_t>(1, (mcu + restart_interval_ - 1) / restart_interval_);
+            while ((interval - 1) % 8 != static_cast<size_t>(marker - 0xD0)) {
+                ++interval;
+            }
+            if (interval * restart_interval_ < mcus) {
+                *restarts = interval - 1;
+                return interval * restart_interval_;
+            }
+            file_.GetWord();
+        }
+        return mcus;
+    }
 
-                if ((j + is_odd) % 2) {
-                    block[i][j + block.size() - 1 - i] = coef;
-                } else {
-                    block[j + block.size() - 1 - i][i] = coef;
+    /* Tolerant mode: skips entropy-coded bytes up to the next marker and returns its second byte,
+     * -1 at EOF. Restart markers are skipped as well when asked to. */
+    int SkipToMarker(bool skip_restarts) {
+        while (file_.PeekByte() != EOF) {
+            if (file_.PeekByte() == 0xFF) {
+                auto position = file_.Position();
+                file_.GetByte();
+                int next = file_.PeekByte();
+                if (next == EOF) {
+                    break;
                 }
+                bool restart = next >= 0xD0 && next <= 0xD7;
+                if (next != 0x00 && next != 0xFF && !(restart && skip_restarts)) {
+                    file_.Seek(position);
+                    return next;
+                }
+                if (next != 0xFF) {
+                    file_.GetByte();
+                }
+            } else {
+                file_.GetByte();
             }
+            context_->damaged = true;
         }
+        return -1;
     }
 
-    template <typename T>
-    void Dequant(std::vector<std::vector<T>>& block, size_t qt_id) {
-        for (size_t i = 0; i < block.size(); ++i) {
-            for (size_t j = 0; j < block.size(); ++j) {
-                block[i][j] *= quantification_tables_[qt_id][i][j];
+    void ReadRestartMarker(const Scan& scan, size_t restarts) {
+        bit_reader_.Reset();
+        auto position = file_.Position();
+        bool found = file_.PeekByte() == 0xFF;
+        if (found) {
+            file_.GetByte();
+            found = file_.PeekByte() == static_cast<int>(0xD0 + restarts % 8);
+        }
+        if (!found) {
+            file_.Seek(position);
+            bit_reader_.Fail(DecodeError::kBadRestartMarker);
+            return;
+        }
+        file_.GetByte();
+        for (auto&& scan_component : scan.components) {
+            components_[scan_component.component].last_DC = 0;
+        }
+    }
+
+    /* DQT lists the values in zigzag order */
+    void FillQTWith(Block& quantification_table, File& file,
+                    std::function<uint16_t(File&)>&& func) {
+        for (auto position : kZigzagOrder) {
+            quantification_table[position / BLOCK_SIZE][position % BLOCK_SIZE] = func(file);
+        }
+    }
+
+    /* Returns the zigzag position of EOB */
+    size_t ReadBlock(Block& block, size_t component_id) {
+        using namespace standard_huffman;
+        auto& component = components_[component_id];
+        switch (component.standard_tables) {
+            case StandardTables::kLuminance:
+                ReadDCWith(block, component, StaticHuffmanDecoder<kLuminanceDCDecoder>());
+                return ReadACWith(block, StaticHuffmanDecoder<kLuminanceACDecoder>());
+            case StandardTables::kChrominance:
+                ReadDCWith(block, component, StaticHuffmanDecoder<kChrominanceDCDecoder>());
+                return ReadACWith(block, StaticHuffmanDecoder<kChrominanceACDecoder>());
+            default:
+                ReadDCWith(block, component, *component.decoders[DC]);
+                return ReadACWith(block, *component.decoders[AC]);
+        }
+    }
+
+    void ReadDC(Block& block, size_t component_id) {
+        ReadDCWith(block, components_[component_id], *components_[component_id].decoders[DC]);
+    }
+
+    void ReadAC(Block& block, size_t component_id) {
+        ReadACWith(block, *components_[component_id].decoders[AC]);
+    }
+
+    template <typename HuffmanDecoderType>
+    void ReadDCWith(Block& block, Component& component, const HuffmanDecoderType& decoder) {
+        size_t coef_size = decoder.DecodeNext(&bit_reader_);
+        int coef = component.last_DC;
+        if (coef_size > 11) {
+            /* Differences of 8-bit samples take at most 11 bits */
+            bit_reader_.Fail(DecodeError::kCoefficientOverflow);
+        } else if (coef_size != 0) {
+            coef += GetCoef(coef_size);
+        }
+        block[0][0] = coef;
+        component.last_DC = coef;
+    }
+
+    /* A run of zeros is skipped at once, the block is zero where nothing is written */
+    template <typename HuffmanDecoderType>
+    size_t ReadACWith(Block& block, const HuffmanDecoderType& decoder) {
+        size_t zeros = 0;
+        int coef = 0;
+        for (size_t k = 1; k < kZigzagOrder.size(); ++k) {
+            if (!ReadRunAndCoef(decoder, &zeros, &coef)) {
+                return k;
             }
+            k += zeros;
+            if (k >= kZigzagOrder.size()) {
+                /* A run of zeros past the last coefficient */
+                bit_reader_.Fail(DecodeError::kCoefficientOverflow);
+                break;
+            }
+            auto position = kZigzagOrder[k];
+            block[position / BLOCK_SIZE][position % BLOCK_SIZE] = coef;
         }
+        return BLOCK_SIZE * BLOCK_SIZE;
+    }
+
+    /* False at EOB and when decoding failed */
+    template <typename HuffmanDecoderType>
+    bool ReadRunAndCoef(const HuffmanDecoderType& decoder, size_t* zeros, int* coef) {
+        if (decoder.DecodeAC(&bit_reader_, zeros, coef)) {
+            return *zeros || *coef;
+        }
+        uint8_t byte = decoder.DecodeNext(&bit_reader_);
+        if (!byte) {
+            return false;
+        }
+        *zeros = byte >> 4;
+        size_t coef_size = byte & 0x0F;
+        if (coef_size > 10) {
+            bit_reader_.Fail(DecodeError::kCoefficientOverflow);
+            return false;
+        }
+        *coef = GetCoef(coef_size);
+        return true;
+    }
+
+    void Dequant(Block& block, size_t qt_id) {
+        Dequantize(block, quantification_tables_[qt_id]);
     }
 
     int GetCoef(size_t size) {
-        int coef = 0;
-        for (size_t i = 0; i < size; ++i) {
-            coef |= static_cast<int>(file_.GetBit()) << (size - i - 1);
+        if (!size) {
+            return 0;
         }
+        int coef = bit_reader_.GetBits(size);
         if (!(coef & (1 << (size - 1)))) {
             coef -= (1 << size) - 1;
         }
         return coef;
     }
 
-    size_t GetNumberOfComponentsByOneDimension(size_t size, size_t thinning) {
+    size_t GetNumberOfComponentsByOneDimension(size_t size, size_t thinning) const {
         size_t thinned_size = size / thinning + (size / thinning * thinning != size);
         size_t number_of_components = (thinned_size) / 8 + (thinned_size / 8 * 8 != thinned_size);
 
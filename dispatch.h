@@ -0,0 +1,149 @@
+#pragma once
+
+#include "color.h"
+#include "idct.h"
+#include "simd.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <optional>
+#include <string>
+
+/* Instruction sets with kernels of their own, each level implies the ones below */
+enum class CpuLevel {
+    kScalar,
+    kSSE4,
+    kAVX2,
+    kAVX512
+};
+
+inline const char* CpuLevelName(CpuLevel level) {
+    switch (level) {
+        case CpuLevel::kSSE4:
+            return "sse4";
+        case CpuLevel::kAVX2:
+            return "avx2";
+        case CpuLevel::kAVX512:
+            return "avx512";
+        default:
+            return "scalar";
+    }
+}
+
+/* Empty for names that are not a level */
+inline std::optional<CpuLevel> CpuLevelByName(const std::string& name) {
+    for (auto level : {CpuLevel::kScalar, CpuLevel::kSSE4, CpuLevel::kAVX2, CpuLevel::kAVX512}) {
+        if (name == CpuLevelName(level)) {
+            return level;
+        }
+    }
+    return std::nullopt;
+}
+
+/* Probed once */
+inline CpuLevel DetectCpuLevel() {
+#if defined(__x86_64__) || defined(__i386__)
+    static const CpuLevel level = [] {
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f")) {
+            return CpuLevel::kAVX512;
+        }
+        if (__builtin_cpu_supports("avx2")) {
+            return CpuLevel::kAVX2;
+        }
+        if (__builtin_cpu_supports("sse4.1")) {
+            return CpuLevel::kSSE4;
+        }
+        return CpuLevel::kScalar;
+    }();
+    return level;
+#else
+    return CpuLevel::kScalar;
+#endif
+}
+
+/* Every kernel family that has SIMD variants */
+struct Kernels {
+    CpuLevel level;
+    void (*inverse_dct)(const Block& block, uint8_t* output, size_t stride);
+    /* Indexed by IDCTMode, each takes the quantization table as IDCTTable gives it */
+    std::array<void (*)(const Block* blocks, size_t count, const Block& quantization_table,
+                        uint8_t* output, size_t stride), kIDCTModes> inverse_dct_row;
+    void (*upsample_row)(const uint8_t* input, size_t h, size_t h_max, size_t width,
+                         uint8_t* output);
+    void (*convert_row)(const uint8_t* y, const uint8_t* cb, const uint8_t* cr, size_t width,
+                        RGB* output);
+    size_t (*find_marker_byte)(const uint8_t* data, size_t size);
+};
+
+/* Levels above the CPU's fall back to it. A single 8x8 block doesn't fill AVX-512 registers and
+ * byte shuffles and compares would need AVX512BW, so AVX-512 has its own color conversion and
+ * float row IDCT, which takes blocks two at a time, and the AVX2 kernels otherwise. */
+inline const Kernels& KernelsFor(CpuLevel level) {
+    static const Kernels kScalar = {CpuLevel::kScalar, InverseDCT,
+                                    {InverseDCTRow, InverseDCTRowAccurate, InverseDCTRowFast},
+                                    UpsampleRow, ConvertRow, FindMarkerByte};
+#if defined(__x86_64__) || defined(__i386__)
+    static const Kernels kSSE4 = {CpuLevel::kSSE4, InverseDCTSSE4,
+                                  {InverseDCTRowSSE4, InverseDCTRowAccurateSSE4,
+                                   InverseDCTRowFastSSE4},
+                                  UpsampleRowSSE4, ConvertRowSSE4, FindMarkerByteSSE4};
+    static const Kernels kAVX2 = {CpuLevel::kAVX2, InverseDCTAVX2,
+                                  {InverseDCTRowAVX2, InverseDCTRowAccurateAVX2,
+                                   InverseDCTRowFastAVX2},
+                                  UpsampleRowAVX2, ConvertRowAVX2, FindMarkerByteAVX2};
+    static const Kernels kAVX512 = {CpuLevel::kAVX512, InverseDCTAVX2,
+                                    {InverseDCTRowAVX512, InverseDCTRowAccurateAVX2,
+                                     InverseDCTRowFastAVX2},
+                                    UpsampleRowAVX2, ConvertRowAVX512, FindMarkerByteAVX2};
+    level = std::min(level, DetectCpuLevel());
+    switch (level) {
+        case CpuLevel::kSSE4:
+            return kSSE4;
+        case CpuLevel::kAVX2:
+            return kAVX2;
+        case CpuLevel::kAVX512:
+            return kAVX512;
+        default:
+            break;
+    }
+#endif
+    return kScalar;
+}
+
+namespace dispatch_internal {
+
+/* The detected level, lowered by JPEG_DECODER_CPU=scalar|sse4|avx2|avx512. Initializes a
+ * function-local static, so an unknown name only warns and keeps the detected level */
+inline const Kernels* DefaultKernels() {
+    auto level = DetectCpuLevel();
+    if (auto name = std::getenv("JPEG_DECODER_CPU")) {
+        if (auto requested = CpuLevelByName(name)) {
+            level = std::min(level, *requested);
+        } else {
+            std::fprintf(stderr, "Ignoring unknown JPEG_DECODER_CPU=%s\n", name);
+        }
+    }
+    return &KernelsFor(level);
+}
+
+inline std::atomic<const Kernels*>& BoundKernels() {
+    static std::atomic<const Kernels*> kernels(DefaultKernels());
+    return kernels;
+}
+
+}  // namespace dispatch_internal
+
+/* What decodes use from now on, decodes already running keep theirs */
+inline const Kernels& GetKernels() {
+    return *dispatch_internal::BoundKernels().load(std::memory_order_acquire);
+}
+
+/* Forces a level for testing, capped at what the CPU supports */
+inline void SetCpuLevel(CpuLevel level) {
+    dispatch_internal::BoundKernels().store(&KernelsFor(level), std::memory_order_release);
+}
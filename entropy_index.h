@@ -0,0 +1,122 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+/* Decoder state at the start of every rows-th MCU row of a single-scan frame, enough to start
+ * entropy decoding there without the rows above. Building one takes a full decode, saving it
+ * next to the file lets any later decode of a band of rows skip to the closest checkpoint. */
+struct EntropyIndex {
+    struct Checkpoint {
+        uint32_t mcu_row = 0;
+        /* The byte holding the next bit of entropy-coded data and the bits of it already read */
+        uint64_t offset = 0;
+        uint8_t bit = 0;
+        uint32_t restarts = 0;
+        std::array<int32_t, 3> last_DC{};
+    };
+
+    /* Of the frame, a file that doesn't match them can't use the index */
+    uint32_t width = 0;
+    uint32_t height = 0;
+    uint32_t rows = 0;
+    /* In order of their rows, rows apart unless damaged data was skipped */
+    std::vector<Checkpoint> checkpoints;
+
+    /* The last checkpoint at or above mcu_row */
+    const Checkpoint& Find(size_t mcu_row) const {
+        if (checkpoints.empty() || checkpoints.front().mcu_row > mcu_row) {
+            throw std::runtime_error("No checkpoint above the row");
+        }
+        size_t begin = 0;
+        size_t end = checkpoints.size();
+        while (end - begin > 1) {
+            size_t middle = (begin + end) / 2;
+            if (checkpoints[middle].mcu_row <= mcu_row) {
+                begin = middle;
+            } else {
+                end = middle;
+            }
+        }
+        return checkpoints[begin];
+    }
+
+    /* Little-endian, 29 bytes per checkpoint */
+    std::string Serialize() const {
+        std::string bytes(kMagic);
+        Put(&bytes, kVersion, 4);
+        Put(&bytes, width, 4);
+        Put(&bytes, height, 4);
+        Put(&bytes, rows, 4);
+        Put(&bytes, checkpoints.size(), 4);
+        for (auto&& checkpoint : checkpoints) {
+            Put(&bytes, checkpoint.mcu_row, 4);
+            Put(&bytes, checkpoint.offset, 8);
+            Put(&bytes, checkpoint.bit, 1);
+            Put(&bytes, checkpoint.restarts, 4);
+            for (auto DC : checkpoint.last_DC) {
+                Put(&bytes, static_cast<uint32_t>(DC), 4);
+            }
+        }
+        return bytes;
+    }
+
+    static EntropyIndex Deserialize(const std::string& bytes) {
+        size_t position = 0;
+        auto get = [&](size_t size) {
+            if (bytes.size() - position < size) {
+                throw std::runtime_error("Truncated index");
+            }
+            uint64_t value = 0;
+            for (size_t i = 0; i < size; ++i) {
+                value |= static_cast<uint64_t>(static_cast<uint8_t>(bytes[position++])) << (8 * i);
+            }
+            return value;
+        };
+        if (bytes.compare(0, kMagic.size(), kMagic) != 0) {
+            throw std::runtime_error("Not an index");
+        }
+        position = kMagic.size();
+        if (get(4) != kVersion) {
+            throw std::runtime_error("Unsupported index version");
+        }
+        EntropyIndex index;
+        index.width = get(4);
+        index.height = get(4);
+        index.rows = get(4);
+        size_t count = get(4);
+        if (count > (bytes.size() - position) / kCheckpointSize) {
+            throw std::runtime_error("Truncated index");
+        }
+        index.checkpoints.resize(count);
+        for (size_t i = 0; i < count; ++i) {
+            auto& checkpoint = index.checkpoints[i];
+            checkpoint.mcu_row = get(4);
+            checkpoint.offset = get(8);
+            checkpoint.bit = get(1);
+            checkpoint.restarts = get(4);
+            for (auto&& DC : checkpoint.last_DC) {
+                DC = static_cast<int32_t>(get(4));
+            }
+            if (checkpoint.bit > 7 || (i && checkpoint.mcu_row <= index.checkpoints[i - 1].mcu_row)) {
+                throw std::runtime_error("Bad checkpoint");
+            }
+        }
+        return index;
+    }
+
+private:
+    static inline const std::string kMagic = "JDIX";
+    static constexpr uint32_t kVersion = 1;
+    static constexpr size_t kCheckpointSize = 29;
+
+    static void Put(std::string* bytes, uint64_t value, size_t size) {
+        for (size_t i = 0; i < size; ++i) {
+            bytes->push_back(static_cast<char>(value >> (8 * i)));
+        }
+    }
+};
@@ -0,0 +1,34 @@
+#include "decoder.h"
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+namespace {
+
+DecodeLimits FuzzLimits() {
+    DecodeLimits limits;
+    limits.max_pixels = 4096 * 4096;
+    limits.max_memory = 512 << 20;
+    limits.max_scans = 64;
+    limits.max_time = std::chrono::milliseconds(1000);
+    return limits;
+}
+
+}  // namespace
+
+/* libFuzzer entry point. Limits keep a single input from eating the fuzzer's memory or time,
+ * an error is a rejected file, crashes, sanitizer reports and escaped exceptions are bugs.
+ * Rejected files go through the tolerant decode as well. */
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+    static DecoderContext context;
+    context.limits = FuzzLimits();
+
+    for (bool tolerant : {false, true}) {
+        context.tolerant = tolerant;
+        if (TryDecode(data, size, &context)) {
+            break;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,311 @@
+#pragma once
+
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+
+constexpr size_t BLOCK_SIZE = 8;
+
+using Block = std::array<std::array<int, BLOCK_SIZE>, BLOCK_SIZE>;
+
+/* kAccurate is libjpeg's default integer IDCT (islow), samples are exactly its own. kFast is its
+ * AAN one (ifast), off by a few levels where quantization is fine. kFloat is ours. */
+enum class IDCTMode {
+    kFloat,
+    kAccurate,
+    kFast
+};
+
+constexpr size_t kIDCTModes = 3;
+
+inline const char* IDCTModeName(IDCTMode mode) {
+    switch (mode) {
+        case IDCTMode::kAccurate:
+            return "accurate";
+        case IDCTMode::kFast:
+            return "fast";
+        default:
+            return "float";
+    }
+}
+
+/* Natural (row * 8 + column) position of the k-th coefficient in zigzag order */
+constexpr std::array<uint8_t, 64> kZigzagOrder = {
+         0,  1,  8, 16,  9,  2,  3, 10,
+        17, 24, 32, 25, 18, 11,  4,  5,
+        12, 19, 26, 33, 40, 48, 41, 34,
+        27, 20, 13,  6,  7, 14, 21, 28,
+        35, 42, 49, 56, 57, 50, 43, 36,
+        29, 22, 15, 23, 30, 37, 44, 51,
+        58, 59, 52, 45, 38, 31, 39, 46,
+        53, 60, 61, 54, 47, 55, 62, 63
+};
+
+inline uint8_t ClampSample(int value) {
+    return value < 0 ? 0 : (value > 255 ? 255 : value);
+}
+
+inline void Dequantize(Block& block, const Block& quantization_table) {
+    for (size_t i = 0; i < BLOCK_SIZE; ++i) {
+        for (size_t j = 0; j < BLOCK_SIZE; ++j) {
+            block[i][j] *= quantization_table[i][j];
+        }
+    }
+}
+
+inline bool IsDCOnly(const Block& block) {
+    for (size_t i = 0; i < BLOCK_SIZE; ++i) {
+        for (size_t j = 0; j < BLOCK_SIZE; ++j) {
+            if ((i || j) && block[i][j]) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+/* cosines[x][u] = C(u) / 2 * cos((2x + 1)u pi / 16), one pass of the separable IDCT */
+inline const std::array<std::array<float, BLOCK_SIZE>, BLOCK_SIZE>& IDCTCosines() {
+    static const auto cosines = [] {
+        std::array<std::array<float, BLOCK_SIZE>, BLOCK_SIZE> table{};
+        for (size_t x = 0; x < BLOCK_SIZE; ++x) {
+            for (size_t u = 0; u < BLOCK_SIZE; ++u) {
+                double scale = u ? 0.5 : 0.5 / std::sqrt(2.0);
+                table[x][u] = scale * std::cos((2 * x + 1) * u * M_PI / (2 * BLOCK_SIZE));
+            }
+        }
+        return table;
+    }();
+    return cosines;
+}
+
+inline void FillBlock(uint8_t sample, uint8_t* output, size_t stride) {
+    for (size_t y = 0; y < BLOCK_SIZE; ++y) {
+        for (size_t x = 0; x < BLOCK_SIZE; ++x) {
+            output[y * stride + x] = sample;
+        }
+    }
+}
+
+/* Of a block with the dequantized DC coefficient only */
+inline void InverseDCTOfDC(int DC, uint8_t* output, size_t stride) {
+    FillBlock(ClampSample(static_cast<int>(std::lround(DC / 8.0)) + 128), output, stride);
+}
+
+/* The same rounded as the integer IDCTs round it, their DC is scaled up by 2^(kShift - 3) */
+template <int kShift>
+inline void InverseDCTOfIntegerDC(int DC, uint8_t* output, size_t stride) {
+    FillBlock(ClampSample(((DC + (1 << (kShift - 1))) >> kShift) + 128), output, stride);
+}
+
+inline void InverseDCTDCOnly(const Block& block, uint8_t* output, size_t stride) {
+    InverseDCTOfDC(block[0][0], output, stride);
+}
+
+/* Dequantized block to samples: level shifted by 128 and clamped, rows are stride bytes apart */
+inline void InverseDCT(const Block& block, uint8_t* output, size_t stride) {
+    if (IsDCOnly(block)) {
+        InverseDCTDCOnly(block, output, stride);
+        return;
+    }
+
+    auto& cosines = IDCTCosines();
+    std::array<std::array<float, BLOCK_SIZE>, BLOCK_SIZE> rows;
+    for (size_t v = 0; v < BLOCK_SIZE; ++v) {
+        for (size_t x = 0; x < BLOCK_SIZE; ++x) {
+            float sum = 0;
+            for (size_t u = 0; u < BLOCK_SIZE; ++u) {
+                sum += cosines[x][u] * block[v][u];
+            }
+            rows[v][x] = sum;
+        }
+    }
+    for (size_t y = 0; y < BLOCK_SIZE; ++y) {
+        for (size_t x = 0; x < BLOCK_SIZE; ++x) {
+            float sum = 0;
+            for (size_t v = 0; v < BLOCK_SIZE; ++v) {
+                sum += cosines[y][v] * rows[v][x];
+            }
+            /* Truncation only differs from rounding below zero, which is clamped anyway */
+            output[y * stride + x] = ClampSample(static_cast<int>(sum + 128.5f));
+        }
+    }
+}
+
+/* One 1-D pass of jidctint.c over v[0..7], lane for lane when T is a vector of ints. Products
+ * have 13 fractional bits, bias is added to them before they are shifted back down. Inlined
+ * into every kernel so that vector lanes get the instruction set of the kernel. */
+template <class T>
+__attribute__((always_inline)) inline void AccurateIDCTPass(T* v, int bias, int shift) {
+    T z1 = (v[2] + v[6]) * 4433;
+    T even2 = z1 + v[6] * -15137;
+    T even3 = z1 + v[2] * 6270;
+    T even0 = (v[0] + v[4]) * 8192 + bias;
+    T even1 = (v[0] - v[4]) * 8192 + bias;
+    T tmp10 = even0 + even3;
+    T tmp13 = even0 - even3;
+    T tmp11 = even1 + even2;
+    T tmp12 = even1 - even2;
+
+    z1 = v[7] + v[1];
+    T z2 = v[5] + v[3];
+    T z3 = v[7] + v[3];
+    T z4 = v[5] + v[1];
+    T z5 = (z3 + z4) * 9633;
+    z1 = z1 * -7373;
+    z2 = z2 * -20995;
+    z3 = z3 * -16069 + z5;
+    z4 = z4 * -3196 + z5;
+    T odd0 = v[7] * 2446 + z1 + z3;
+    T odd1 = v[5] * 16819 + z2 + z4;
+    T odd2 = v[3] * 25172 + z2 + z3;
+    T odd3 = v[1] * 12299 + z1 + z4;
+
+    v[0] = (tmp10 + odd3) >> shift;
+    v[7] = (tmp10 - odd3) >> shift;
+    v[1] = (tmp11 + odd2) >> shift;
+    v[6] = (tmp11 - odd2) >> shift;
+    v[2] = (tmp12 + odd1) >> shift;
+    v[5] = (tmp12 - odd1) >> shift;
+    v[3] = (tmp13 + odd0) >> shift;
+    v[4] = (tmp13 - odd0) >> shift;
+}
+
+/* One 1-D pass of jidctfst.c, products have 8 fractional bits and are truncated at once. The
+ * AAN scale factors are in the quantization table, bias is added to the DC. */
+template <class T>
+__attribute__((always_inline)) inline void FastIDCTPass(T* v, int bias, int shift) {
+    T DC = v[0] + bias;
+    T tmp10 = DC + v[4];
+    T tmp11 = DC - v[4];
+    T tmp13 = v[2] + v[6];
+    T tmp12 = (((v[2] - v[6]) * 362) >> 8) - tmp13;
+    T even0 = tmp10 + tmp13;
+    T even3 = tmp10 - tmp13;
+    T even1 = tmp11 + tmp12;
+    T even2 = tmp11 - tmp12;
+
+    T z13 = v[5] + v[3];
+    T z10 = v[5] - v[3];
+    T z11 = v[1] + v[7];
+    T z12 = v[1] - v[7];
+    T odd7 = z11 + z13;
+    T odd11 = ((z11 - z13) * 362) >> 8;
+    T z5 = ((z10 + z12) * 473) >> 8;
+    T odd10 = ((z12 * 277) >> 8) - z5;
+    T odd12 = ((z10 * -669) >> 8) + z5;
+    T odd6 = odd12 - odd7;
+    T odd5 = odd11 - odd6;
+    T odd4 = odd10 + odd5;
+
+    v[0] = (even0 + odd7) >> shift;
+    v[7] = (even0 - odd7) >> shift;
+    v[1] = (even1 + odd6) >> shift;
+    v[6] = (even1 - odd6) >> shift;
+    v[2] = (even2 + odd5) >> shift;
+    v[5] = (even2 - odd5) >> shift;
+    v[4] = (even3 + odd4) >> shift;
+    v[3] = (even3 - odd4) >> shift;
+}
+
+/* Columns first, keeping 2 bits more than the samples have, then rows, which also round and
+ * level shift */
+template <IDCTMode kMode, bool kRows, class T>
+__attribute__((always_inline)) inline void IntegerIDCTPass(T* v) {
+    static_assert(kMode != IDCTMode::kFloat);
+    if constexpr (kMode == IDCTMode::kAccurate) {
+        AccurateIDCTPass(v, kRows ? (1 << 17) + (128 << 18) : 1 << 10, kRows ? 18 : 11);
+    } else {
+        FastIDCTPass(v, kRows ? (1 << 4) + (128 << 5) : 0, kRows ? 5 : 0);
+    }
+}
+
+/* Of a block dequantized as the mode needs it */
+template <IDCTMode kMode>
+inline void InverseDCTInteger(const Block& block, uint8_t* output, size_t stride) {
+    Block columns;
+    for (size_t x = 0; x < BLOCK_SIZE; ++x) {
+        std::array<int, BLOCK_SIZE> v;
+        for (size_t y = 0; y < BLOCK_SIZE; ++y) {
+            v[y] = block[y][x];
+        }
+        IntegerIDCTPass<kMode, false>(v.data());
+        for (size_t y = 0; y < BLOCK_SIZE; ++y) {
+            columns[y][x] = v[y];
+        }
+    }
+    for (size_t y = 0; y < BLOCK_SIZE; ++y) {
+        IntegerIDCTPass<kMode, true>(columns[y].data());
+        for (size_t x = 0; x < BLOCK_SIZE; ++x) {
+            output[y * stride + x] = ClampSample(columns[y][x]);
+        }
+    }
+}
+
+/* The quantization table of the fast IDCT: scaled by the AAN factors of both frequencies,
+ * cos(k pi / 16) * sqrt(2) but 1 for k = 0, and by 4 for the 2 extra bits of its first pass */
+inline Block AANScaledTable(const Block& quantization_table) {
+    static const auto scales = [] {
+        std::array<std::array<int, BLOCK_SIZE>, BLOCK_SIZE> table{};
+        for (size_t i = 0; i < BLOCK_SIZE; ++i) {
+            for (size_t j = 0; j < BLOCK_SIZE; ++j) {
+                auto factor = [](size_t k) {
+                    return k ? std::cos(k * M_PI / (2 * BLOCK_SIZE)) * std::sqrt(2.0) : 1.0;
+                };
+                table[i][j] = static_cast<int>(std::lround(factor(i) * factor(j) * (1 << 14)));
+            }
+        }
+        return table;
+    }();
+    Block table;
+    for (size_t i = 0; i < BLOCK_SIZE; ++i) {
+        for (size_t j = 0; j < BLOCK_SIZE; ++j) {
+            table[i][j] = (quantization_table[i][j] * scales[i][j] + (1 << 11)) >> 12;
+        }
+    }
+    return table;
+}
+
+/* The quantization table as the row IDCT of mode takes it, computed once per table rather than
+ * once per row */
+inline Block IDCTTable(IDCTMode mode, const Block& quantization_table) {
+    return mode == IDCTMode::kFast ? AANScaledTable(quantization_table) : quantization_table;
+}
+
+/* count quantized blocks side by side from output on, each dequantized on its way through.
+ * A block that is DC-only before it is dequantized is after it, so it isn't even copied. */
+template <void (*kInverseDCT)(const Block&, uint8_t*, size_t),
+          void (*kInverseDCTOfDC)(int, uint8_t*, size_t) = InverseDCTOfDC>
+inline void InverseDCTRowWith(const Block* blocks, size_t count, const Block& quantization_table,
+                              uint8_t* output, size_t stride) {
+    for (size_t i = 0; i < count; ++i) {
+        if (IsDCOnly(blocks[i])) {
+            kInverseDCTOfDC(blocks[i][0][0] * quantization_table[0][0], &output[i * BLOCK_SIZE],
+                            stride);
+            continue;
+        }
+        auto block = blocks[i];
+        Dequantize(block, quantization_table);
+        kInverseDCT(block, &output[i * BLOCK_SIZE], stride);
+    }
+}
+
+inline void InverseDCTRow(const Block* blocks, size_t count, const Block& quantization_table,
+                          uint8_t* output, size_t stride) {
+    InverseDCTRowWith<InverseDCT>(blocks, count, quantization_table, output, stride);
+}
+
+inline void InverseDCTRowAccurate(const Block* blocks, size_t count,
+                                  const Block& quantization_table, uint8_t* output,
+                                  size_t stride) {
+    InverseDCTRowWith<InverseDCTInteger<IDCTMode::kAccurate>, InverseDCTOfIntegerDC<3>>(
+            blocks, count, quantization_table, output, stride);
+}
+
+/* quantization_table is the AANScaledTable, as IDCTTable gives it */
+inline void InverseDCTRowFast(const Block* blocks, size_t count, const Block& quantization_table,
+                              uint8_t* output, size_t stride) {
+    InverseDCTRowWith<InverseDCTInteger<IDCTMode::kFast>, InverseDCTOfIntegerDC<5>>(
+            blocks, count, quantization_table, output, stride);
+}
@@ -15,19 +15,24 @@ public:
         SetSize(width, height);
     }
 
+    /* Rows are never shrunk, so a reused Image doesn't reallocate for smaller sizes */
     void SetSize(size_t width, size_t height) {
-        data_.assign(height, std::vector<RGB>(width));
+        if (data_.size() < height) {
+            data_.resize(height);
+        }
+        for (size_t y = 0; y < height; ++y) {
+            data_[y].assign(width, RGB());
+        }
+        width_ = width;
+        height_ = height;
     }
 
     size_t Width() const {
-        if (data_.empty()) {
-            return 0;
-        }
-        return data_[0].size();
+        return width_;
     }
 
     size_t Height() const {
-        return data_.size();
+        return height_;
     }
 
     void SetPixel(int y, int x, const RGB& pixel) {
@@ -42,6 +47,10 @@ public:
         return data_[y][x];
     }
 
+    RGB* GetRow(size_t y) {
+        return data_[y].data();
+    }
+
     void SetComment(const std::string& comment) {
         comment_ = comment;
     }
@@ -52,5 +61,7 @@ public:
 
 private:
     std::vector<std::vector<RGB>> data_;
+    size_t width_ = 0;
+    size_t height_ = 0;
     std::string comment_;
 };
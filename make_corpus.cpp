@@ -0,0 +1,60 @@
+#include "corpus.h"
+
+#include <filesystem>
+#include <iostream>
+#include <string>
+#include <vector>
+
+/* Writes a deterministic set of synthetic JPEGs for benchmarks and scaling tests:
+ * every subsampling mode with and without restart markers, baseline and progressive,
+ * quality varying between files. Sizes above --max_size (4096 by default) are skipped,
+ * --max_size=16384 also writes the 16k x 16k images. */
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        std::cerr << "Usage: " << argv[0] << " <output dir> [--max_size=N]" << std::endl;
+        return 1;
+    }
+    std::filesystem::path output_dir = argv[1];
+    size_t max_size = 4096;
+    for (int i = 2; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg.rfind("--max_size=", 0) == 0) {
+            max_size = std::stoul(arg.substr(arg.find('=') + 1));
+        } else {
+            std::cerr << "Unknown argument " << arg << std::endl;
+            return 1;
+        }
+    }
+    std::filesystem::create_directories(output_dir);
+
+    /* 1000 x 750 is not a whole number of MCUs in any mode */
+    const std::vector<std::pair<size_t, size_t>> sizes = {
+            {64, 64}, {1000, 750}, {4096, 4096}, {16384, 16384}
+    };
+    const int qualities[] = {50, 75, 90, 95};
+    size_t index = 0;
+    for (auto [width, height] : sizes) {
+        if (std::max(width, height) > max_size) {
+            continue;
+        }
+        for (auto subsampling : {Subsampling::k444, Subsampling::k422, Subsampling::k420,
+                                 Subsampling::k411}) {
+            for (size_t restart_interval : {0, 16}) {
+                for (bool progressive : {false, true}) {
+                    SyntheticJpegOptions options;
+                    options.width = width;
+                    options.height = height;
+                    options.subsampling = subsampling;
+                    options.quality = qualities[index++ % std::size(qualities)];
+                    options.restart_interval = restart_interval;
+                    options.progressive = progressive;
+
+                    auto filename = output_dir / SyntheticJpegName(options);
+                    WriteSyntheticJpeg(filename.string(), options);
+                    std::cout << filename.string() << std::endl;
+                }
+            }
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,15 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+/* Offset of the first 0xFF in data, size if there is none. Entropy-coded data has one only
+ * before a stuffed zero or a marker, so the bytes up to it can be taken as they are. */
+inline size_t FindMarkerByte(const uint8_t* data, size_t size) {
+    for (size_t i = 0; i < size; ++i) {
+        if (data[i] == 0xFF) {
+            return i;
+        }
+    }
+    return size;
+}
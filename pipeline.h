@@ -0,0 +1,156 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/* Hands rows to worker threads as soon as the producer has published them. Each row goes to
+ * one worker, in order. Work must not throw. The threads outlive a run of rows and wait for the
+ * next Start, so one pipeline serves every scan of every decode that shares it, and they are
+ * joined when the pipeline is destroyed.
+ *
+ * With a capacity the producer writes rows into a ring of that many slots: row r reuses the slot
+ * of row r - capacity, so Publish waits until that one is done before the producer may go on. */
+class RowPipeline {
+public:
+    using Work = std::function<void(size_t row, size_t worker)>;
+
+    /* Aborts the run it points to instead of deleting the pipeline */
+    struct Aborter {
+        void operator()(RowPipeline* pipeline) const {
+            pipeline->Abort();
+        }
+    };
+
+    RowPipeline() = default;
+
+    RowPipeline(const RowPipeline&) = delete;
+    RowPipeline& operator=(const RowPipeline&) = delete;
+
+    ~RowPipeline() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopped_ = true;
+        }
+        ready_.notify_all();
+        for (auto&& thread : threads_) {
+            thread.join();
+        }
+    }
+
+    /* A run of rows on the first workers threads, starting those the pipeline doesn't have yet.
+     * The previous run must have been finished or aborted. */
+    void Start(size_t rows, size_t workers, Work work, size_t capacity = 0) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        rows_ = rows;
+        workers_ = workers;
+        capacity_ = capacity;
+        work_ = std::move(work);
+        done_.assign(rows, false);
+        ready_rows_ = 0;
+        next_row_ = 0;
+        done_rows_ = 0;
+        aborted_ = false;
+        while (threads_.size() < workers) {
+            threads_.emplace_back([this, worker = threads_.size()] {
+                Run(worker);
+            });
+        }
+    }
+
+    /* Rows before ready may be worked on. With a capacity they are published one at a time, each
+     * once its slot is free, which matters for rows the producer skipped, and this returns when
+     * row ready may be written. */
+    void Publish(size_t ready) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        ready = std::min(ready, rows_);
+        if (!capacity_) {
+            if (ready <= ready_rows_) {
+                return;
+            }
+            ready_rows_ = ready;
+            lock.unlock();
+            ready_.notify_all();
+            return;
+        }
+        while (ready_rows_ < ready) {
+            row_done_.wait(lock, [this] {
+                return aborted_ || ready_rows_ < done_rows_ + capacity_;
+            });
+            ++ready_rows_;
+            ready_.notify_all();
+        }
+        row_done_.wait(lock, [this, ready] {
+            return aborted_ || ready >= rows_ || ready < done_rows_ + capacity_;
+        });
+    }
+
+    /* Publishes every row and waits until all of them are done */
+    void Finish() {
+        Publish(rows_);
+        std::unique_lock<std::mutex> lock(mutex_);
+        row_done_.wait(lock, [this] {
+            return done_rows_ == rows_;
+        });
+        work_ = nullptr;
+    }
+
+    /* Drops the rows nobody has started and waits for those being worked on */
+    void Abort() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        aborted_ = true;
+        row_done_.wait(lock, [this] {
+            return !running_;
+        });
+        work_ = nullptr;
+    }
+
+private:
+    void Run(size_t worker) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (true) {
+            ready_.wait(lock, [this, worker] {
+                return stopped_ || (!aborted_ && worker < workers_ && next_row_ < ready_rows_);
+            });
+            if (stopped_) {
+                return;
+            }
+            size_t row = next_row_++;
+            ++running_;
+            lock.unlock();
+            work_(row, worker);
+            lock.lock();
+            --running_;
+            done_[row] = true;
+            while (done_rows_ < rows_ && done_[done_rows_]) {
+                ++done_rows_;
+            }
+            row_done_.notify_one();
+        }
+    }
+
+    size_t rows_ = 0;
+    size_t workers_ = 0;
+    size_t capacity_ = 0;
+    Work work_;
+
+    std::mutex mutex_;
+    std::condition_variable ready_;
+    /* Only the producer waits on it */
+    std::condition_variable row_done_;
+    size_t ready_rows_ = 0;
+    size_t next_row_ = 0;
+    /* Rows being worked on */
+    size_t running_ = 0;
+    /* Rows before done_rows_ are all done, done_ marks those finished out of order */
+    std::vector<bool> done_;
+    size_t done_rows_ = 0;
+    bool aborted_ = false;
+    bool stopped_ = false;
+
+    std::vector<std::thread> threads_;
+};
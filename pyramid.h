@@ -0,0 +1,176 @@
+#pragma once
+
+#include "decoder.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+/* DeepZoom layout: the last level is the image, each level above it is half as large rounded
+ * up, down to 1x1 at level 0. Tiles are tile_size square plus overlap pixels on inner edges. */
+struct PyramidOptions {
+    size_t tile_size = 254;
+    size_t overlap = 1;
+};
+
+using TileSink = std::function<void(size_t level, size_t column, size_t row, const Image& tile)>;
+
+/* Builds every level at once from the image rows given top to bottom. A level keeps the rows of
+ * its current row of tiles and the overlap, 3 bytes a pixel, and an even row until the odd one
+ * below it comes to be averaged with it into the next level down. */
+class TilePyramid {
+public:
+    TilePyramid(size_t width, size_t height, const PyramidOptions& options, TileSink sink)
+            : options_(options), sink_(std::move(sink)) {
+        if (!options_.tile_size) {
+            throw std::runtime_error("Bad tile size");
+        }
+        size_t levels = 1;
+        while ((size_t(1) << (levels - 1)) < std::max(width, height)) {
+            ++levels;
+        }
+        levels_.resize(levels);
+        for (size_t i = levels; i-- > 0;) {
+            levels_[i].width = width;
+            levels_[i].height = height;
+            width = (width + 1) / 2;
+            height = (height + 1) / 2;
+        }
+    }
+
+    size_t Levels() const {
+        return levels_.size();
+    }
+
+    /* A row of the image, tiles are emitted as soon as their last row is in */
+    void AddRow(const RGB* row) {
+        std::vector<uint8_t> bytes(levels_.back().width * 3);
+        for (size_t x = 0; x < levels_.back().width; ++x) {
+            bytes[x * 3] = row[x].r;
+            bytes[x * 3 + 1] = row[x].g;
+            bytes[x * 3 + 2] = row[x].b;
+        }
+        Add(levels_.size() - 1, std::move(bytes));
+    }
+
+private:
+    struct Level {
+        size_t width = 0;
+        size_t height = 0;
+        size_t rows = 0;
+        /* Level row of the first buffered one */
+        size_t top = 0;
+        std::deque<std::vector<uint8_t>> buffer;
+        std::vector<uint8_t> pending;
+        size_t tile_row = 0;
+    };
+
+    void Add(size_t index, std::vector<uint8_t> row) {
+        auto& level = levels_[index];
+        if (index) {
+            if (level.rows % 2 == 0) {
+                level.pending = row;
+            } else {
+                Add(index - 1, Halve(level.pending, row, level.width));
+            }
+        }
+        level.buffer.push_back(std::move(row));
+        ++level.rows;
+        EmitTiles(index);
+        if (index && level.rows == level.height && level.rows % 2) {
+            Add(index - 1, Halve(level.pending, level.pending, level.width));
+        }
+    }
+
+    /* The 2x2 average, the last column of an odd width is paired with itself */
+    static std::vector<uint8_t> Halve(const std::vector<uint8_t>& top,
+                                      const std::vector<uint8_t>& bottom, size_t width) {
+        std::vector<uint8_t> row((width + 1) / 2 * 3);
+        for (size_t x = 0; x < row.size() / 3; ++x) {
+            size_t left = 2 * x * 3;
+            size_t right = std::min(2 * x + 1, width - 1) * 3;
+            for (size_t c = 0; c < 3; ++c) {
+                row[x * 3 + c] = (top[left + c] + top[right + c] + bottom[left + c]
+                                  + bottom[right + c] + 2) / 4;
+            }
+        }
+        return row;
+    }
+
+    void EmitTiles(size_t index) {
+        auto& level = levels_[index];
+        size_t tile_size = options_.tile_size;
+        size_t overlap = options_.overlap;
+        while (level.tile_row * tile_size < level.height) {
+            size_t begin = level.tile_row * tile_size;
+            begin = begin > overlap ? begin - overlap : 0;
+            size_t end = std::min(level.height, (level.tile_row + 1) * tile_size + overlap);
+            if (level.rows < end) {
+                return;
+            }
+            for (size_t column = 0; column * tile_size < level.width; ++column) {
+                size_t left = column * tile_size;
+                left = left > overlap ? left - overlap : 0;
+                size_t right = std::min(level.width, (column + 1) * tile_size + overlap);
+                tile_.SetSize(right - left, end - begin);
+                for (size_t y = begin; y < end; ++y) {
+                    auto& row = level.buffer[y - level.top];
+                    auto output = tile_.GetRow(y - begin);
+                    for (size_t x = left; x < right; ++x) {
+                        output[x - left] = {row[x * 3], row[x * 3 + 1], row[x * 3 + 2]};
+                    }
+                }
+                sink_(index, column, level.tile_row, tile_);
+            }
+            ++level.tile_row;
+            size_t next = level.tile_row * tile_size;
+            next = next > overlap ? next - overlap : 0;
+            while (level.top < next && !level.buffer.empty()) {
+                level.buffer.pop_front();
+                ++level.top;
+            }
+        }
+    }
+
+    PyramidOptions options_;
+    TileSink sink_;
+    std::vector<Level> levels_;
+    Image tile_;
+};
+
+namespace pyramid_internal {
+
+inline void DecodePyramid(File&& file, const PyramidOptions& options, const TileSink& sink,
+                          DecoderContext* context) {
+    Decoder decoder(std::move(file), context);
+    std::unique_ptr<TilePyramid> pyramid;
+    decoder.SetRowSink([&](size_t, const RGB* row) {
+        if (!pyramid) {
+            pyramid = std::make_unique<TilePyramid>(decoder.GetImage().Width(),
+                                                    decoder.GetFrameHeight(), options, sink);
+        }
+        pyramid->AddRow(row);
+    });
+    decoder.Parse();
+}
+
+}  // namespace pyramid_internal
+
+/* The DeepZoom pyramid of a single-scan file without decoding it whole: rows go from the decoder
+ * through every level as they come, so memory is a few rows of tiles per level and one MCU row
+ * of the decoder rather than the image. Tiles of a level come in rows, left to right. */
+inline void DecodePyramid(const std::string& filename, const PyramidOptions& options,
+                          const TileSink& sink, DecoderContext* context) {
+    pyramid_internal::DecodePyramid(File(filename, &context->file_buffer), options, sink,
+                                    context);
+}
+
+inline void DecodePyramid(const uint8_t* data, size_t size, const PyramidOptions& options,
+                          const TileSink& sink, DecoderContext* context) {
+    pyramid_internal::DecodePyramid(File(data, size), options, sink, context);
+}
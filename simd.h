@@ -0,0 +1,495 @@
+#pragma once
+
+#include "color.h"
+#include "idct.h"
+#include "markers.h"
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <utility>
+
+/* x86 variants of the kernels in idct.h and color.h. Each is compiled for its instruction set
+ * through a target attribute, so the rest of the code builds for the baseline and runs anywhere;
+ * dispatch.h only binds the ones the CPU supports. The results are exactly those of the scalar
+ * kernels: the float IDCT adds its products in the same order and FMA is never enabled, the
+ * integer ones run the scalar passes on vectors of ints. */
+#if defined(__x86_64__) || defined(__i386__)
+
+#include <immintrin.h>
+
+#define SIMD_TARGET(isa) __attribute__((target(isa)))
+
+/* Cosines transposed, [u] is the row of cosines of frequency u for every x */
+inline const std::array<std::array<float, BLOCK_SIZE>, BLOCK_SIZE>& IDCTCosinesByFrequency() {
+    static const auto cosines = [] {
+        std::array<std::array<float, BLOCK_SIZE>, BLOCK_SIZE> table{};
+        for (size_t x = 0; x < BLOCK_SIZE; ++x) {
+            for (size_t u = 0; u < BLOCK_SIZE; ++u) {
+                table[u][x] = IDCTCosines()[x][u];
+            }
+        }
+        return table;
+    }();
+    return cosines;
+}
+
+SIMD_TARGET("sse4.1")
+inline void StoreSamplesSSE4(__m128 low, __m128 high, uint8_t* output) {
+    auto shift = _mm_set1_ps(128.5f);
+    auto words = _mm_packs_epi32(_mm_cvttps_epi32(_mm_add_ps(low, shift)),
+                                 _mm_cvttps_epi32(_mm_add_ps(high, shift)));
+    _mm_storel_epi64(reinterpret_cast<__m128i*>(output), _mm_packus_epi16(words, words));
+}
+
+/* A row of 8 is two halves of 4 */
+SIMD_TARGET("sse4.1")
+inline void InverseDCTSSE4(const Block& block, uint8_t* output, size_t stride) {
+    if (IsDCOnly(block)) {
+        InverseDCTDCOnly(block, output, stride);
+        return;
+    }
+    auto& by_frequency = IDCTCosinesByFrequency();
+    auto& cosines = IDCTCosines();
+    __m128 rows[BLOCK_SIZE][2];
+    for (size_t v = 0; v < BLOCK_SIZE; ++v) {
+        auto low = _mm_setzero_ps();
+        auto high = _mm_setzero_ps();
+        for (size_t u = 0; u < BLOCK_SIZE; ++u) {
+            auto coef = _mm_set1_ps(static_cast<float>(block[v][u]));
+            low = _mm_add_ps(low, _mm_mul_ps(_mm_loadu_ps(&by_frequency[u][0]), coef));
+            high = _mm_add_ps(high, _mm_mul_ps(_mm_loadu_ps(&by_frequency[u][4]), coef));
+        }
+        rows[v][0] = low;
+        rows[v][1] = high;
+    }
+    for (size_t y = 0; y < BLOCK_SIZE; ++y) {
+        auto low = _mm_setzero_ps();
+        auto high = _mm_setzero_ps();
+        for (size_t v = 0; v < BLOCK_SIZE; ++v) {
+            auto cosine = _mm_set1_ps(cosines[y][v]);
+            low = _mm_add_ps(low, _mm_mul_ps(cosine, rows[v][0]));
+            high = _mm_add_ps(high, _mm_mul_ps(cosine, rows[v][1]));
+        }
+        StoreSamplesSSE4(low, high, &output[y * stride]);
+    }
+}
+
+SIMD_TARGET("avx2")
+inline void InverseDCTAVX2(const Block& block, uint8_t* output, size_t stride) {
+    if (IsDCOnly(block)) {
+        InverseDCTDCOnly(block, output, stride);
+        return;
+    }
+    auto& by_frequency = IDCTCosinesByFrequency();
+    auto& cosines = IDCTCosines();
+    __m256 rows[BLOCK_SIZE];
+    for (size_t v = 0; v < BLOCK_SIZE; ++v) {
+        auto sum = _mm256_setzero_ps();
+        for (size_t u = 0; u < BLOCK_SIZE; ++u) {
+            auto coef = _mm256_set1_ps(static_cast<float>(block[v][u]));
+            auto cosines_of_u = _mm256_loadu_ps(by_frequency[u].data());
+            sum = _mm256_add_ps(sum, _mm256_mul_ps(cosines_of_u, coef));
+        }
+        rows[v] = sum;
+    }
+    auto shift = _mm256_set1_ps(128.5f);
+    for (size_t y = 0; y < BLOCK_SIZE; ++y) {
+        auto sum = _mm256_setzero_ps();
+        for (size_t v = 0; v < BLOCK_SIZE; ++v) {
+            sum = _mm256_add_ps(sum, _mm256_mul_ps(_mm256_set1_ps(cosines[y][v]), rows[v]));
+        }
+        auto samples = _mm256_cvttps_epi32(_mm256_add_ps(sum, shift));
+        auto words = _mm_packs_epi32(_mm256_castsi256_si128(samples),
+                                     _mm256_extracti128_si256(samples, 1));
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(&output[y * stride]),
+                         _mm_packus_epi16(words, words));
+    }
+}
+
+inline void InverseDCTRowSSE4(const Block* blocks, size_t count, const Block& quantization_table,
+                              uint8_t* output, size_t stride) {
+    InverseDCTRowWith<InverseDCTSSE4>(blocks, count, quantization_table, output, stride);
+}
+
+inline void InverseDCTRowAVX2(const Block* blocks, size_t count, const Block& quantization_table,
+                              uint8_t* output, size_t stride) {
+    InverseDCTRowWith<InverseDCTAVX2>(blocks, count, quantization_table, output, stride);
+}
+
+/* avx512f brings FMA along, which the compiler would fuse these into. Explicit rounding, the
+ * same as the default, keeps the products rounded like the scalar kernel's. */
+#define ADD_PS_512(a, b) _mm512_add_round_ps(a, b, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC)
+#define MUL_PS_512(a, b) _mm512_mul_round_ps(a, b, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC)
+
+/* Two blocks at once, the first in the low half of every register and the second in the high
+ * one, with the arithmetic of InverseDCTAVX2 lane for lane */
+SIMD_TARGET("avx512f")
+inline void InverseDCTPairAVX512(const Block& first, uint8_t* first_output, const Block& second,
+                                 uint8_t* second_output, size_t stride) {
+    auto& by_frequency = IDCTCosinesByFrequency();
+    auto& cosines = IDCTCosines();
+    __m512 rows[BLOCK_SIZE];
+    for (size_t v = 0; v < BLOCK_SIZE; ++v) {
+        auto sum = _mm512_setzero_ps();
+        for (size_t u = 0; u < BLOCK_SIZE; ++u) {
+            auto coefs = _mm512_mask_blend_ps(0xFF00,
+                                              _mm512_set1_ps(static_cast<float>(first[v][u])),
+                                              _mm512_set1_ps(static_cast<float>(second[v][u])));
+            auto cosines_of_u = _mm512_castsi512_ps(_mm512_broadcast_i64x4(
+                    _mm256_loadu_si256(reinterpret_cast<const __m256i*>(by_frequency[u].data()))));
+            sum = ADD_PS_512(sum, MUL_PS_512(cosines_of_u, coefs));
+        }
+        rows[v] = sum;
+    }
+    auto shift = _mm512_set1_ps(128.5f);
+    for (size_t y = 0; y < BLOCK_SIZE; ++y) {
+        auto sum = _mm512_setzero_ps();
+        for (size_t v = 0; v < BLOCK_SIZE; ++v) {
+            sum = ADD_PS_512(sum, MUL_PS_512(_mm512_set1_ps(cosines[y][v]), rows[v]));
+        }
+        auto samples = _mm512_max_epi32(_mm512_cvttps_epi32(ADD_PS_512(sum, shift)),
+                                        _mm512_setzero_si512());
+        auto bytes = _mm512_cvtusepi32_epi8(samples);
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(&first_output[y * stride]), bytes);
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(&second_output[y * stride]),
+                         _mm_unpackhi_epi64(bytes, bytes));
+    }
+}
+
+#undef ADD_PS_512
+#undef MUL_PS_512
+
+/* Dense blocks are paired wherever they are in the row, DC-only ones are filled as they come */
+SIMD_TARGET("avx512f")
+inline void InverseDCTRowAVX512(const Block* blocks, size_t count,
+                                const Block& quantization_table, uint8_t* output, size_t stride) {
+    Block pending;
+    uint8_t* pending_output = nullptr;
+    for (size_t i = 0; i < count; ++i) {
+        if (IsDCOnly(blocks[i])) {
+            InverseDCTOfDC(blocks[i][0][0] * quantization_table[0][0], &output[i * BLOCK_SIZE],
+                           stride);
+            continue;
+        }
+        auto block = blocks[i];
+        Dequantize(block, quantization_table);
+        if (IsDCOnly(block)) {
+            InverseDCTDCOnly(block, &output[i * BLOCK_SIZE], stride);
+        } else if (!pending_output) {
+            pending = block;
+            pending_output = &output[i * BLOCK_SIZE];
+        } else {
+            InverseDCTPairAVX512(pending, pending_output, block, &output[i * BLOCK_SIZE], stride);
+            pending_output = nullptr;
+        }
+    }
+    if (pending_output) {
+        InverseDCTAVX2(pending, pending_output, stride);
+    }
+}
+
+SIMD_TARGET("sse4.1")
+inline void Transpose4x4SSE4(__v4si* rows) {
+    auto low01 = _mm_unpacklo_epi32((__m128i)rows[0], (__m128i)rows[1]);
+    auto high01 = _mm_unpackhi_epi32((__m128i)rows[0], (__m128i)rows[1]);
+    auto low23 = _mm_unpacklo_epi32((__m128i)rows[2], (__m128i)rows[3]);
+    auto high23 = _mm_unpackhi_epi32((__m128i)rows[2], (__m128i)rows[3]);
+    rows[0] = (__v4si)_mm_unpacklo_epi64(low01, low23);
+    rows[1] = (__v4si)_mm_unpackhi_epi64(low01, low23);
+    rows[2] = (__v4si)_mm_unpacklo_epi64(high01, high23);
+    rows[3] = (__v4si)_mm_unpackhi_epi64(high01, high23);
+}
+
+/* Of rows whose columns 0-3 are in low and 4-7 in high: quarters are transposed in place and
+ * the two off the diagonal swapped */
+SIMD_TARGET("sse4.1")
+inline void Transpose8x8SSE4(__v4si* low, __v4si* high) {
+    Transpose4x4SSE4(low);
+    Transpose4x4SSE4(&low[4]);
+    Transpose4x4SSE4(high);
+    Transpose4x4SSE4(&high[4]);
+    for (size_t i = 0; i < 4; ++i) {
+        std::swap(low[4 + i], high[i]);
+    }
+}
+
+/* The integer IDCTs a row of 8 at a time, with two halves of 4 lanes. The arithmetic is that of
+ * the scalar kernel lane for lane, it is exact. */
+template <IDCTMode kMode>
+SIMD_TARGET("sse4.1")
+inline void InverseDCTIntegerSSE4(const Block& block, uint8_t* output, size_t stride) {
+    __v4si low[BLOCK_SIZE];
+    __v4si high[BLOCK_SIZE];
+    for (size_t y = 0; y < BLOCK_SIZE; ++y) {
+        low[y] = (__v4si)_mm_loadu_si128(reinterpret_cast<const __m128i*>(&block[y][0]));
+        high[y] = (__v4si)_mm_loadu_si128(reinterpret_cast<const __m128i*>(&block[y][4]));
+    }
+    IntegerIDCTPass<kMode, false>(low);
+    IntegerIDCTPass<kMode, false>(high);
+    Transpose8x8SSE4(low, high);
+    IntegerIDCTPass<kMode, true>(low);
+    IntegerIDCTPass<kMode, true>(high);
+    Transpose8x8SSE4(low, high);
+    for (size_t y = 0; y < BLOCK_SIZE; ++y) {
+        auto words = _mm_packs_epi32((__m128i)low[y], (__m128i)high[y]);
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(&output[y * stride]),
+                         _mm_packus_epi16(words, words));
+    }
+}
+
+SIMD_TARGET("avx2")
+inline void Transpose8x8AVX2(__v8si* rows) {
+    __m256i pairs[BLOCK_SIZE];
+    for (size_t i = 0; i < BLOCK_SIZE; i += 2) {
+        pairs[i] = _mm256_unpacklo_epi32((__m256i)rows[i], (__m256i)rows[i + 1]);
+        pairs[i + 1] = _mm256_unpackhi_epi32((__m256i)rows[i], (__m256i)rows[i + 1]);
+    }
+    __m256i quads[BLOCK_SIZE];
+    for (size_t i = 0; i < BLOCK_SIZE; i += 4) {
+        quads[i] = _mm256_unpacklo_epi64(pairs[i], pairs[i + 2]);
+        quads[i + 1] = _mm256_unpackhi_epi64(pairs[i], pairs[i + 2]);
+        quads[i + 2] = _mm256_unpacklo_epi64(pairs[i + 1], pairs[i + 3]);
+        quads[i + 3] = _mm256_unpackhi_epi64(pairs[i + 1], pairs[i + 3]);
+    }
+    /* Rows 0-3 of the columns are in the low lanes of quads[0..3], rows 4-7 in quads[4..7] */
+    for (size_t i = 0; i < 4; ++i) {
+        rows[i] = (__v8si)_mm256_permute2x128_si256(quads[i], quads[i + 4], 0x20);
+        rows[i + 4] = (__v8si)_mm256_permute2x128_si256(quads[i], quads[i + 4], 0x31);
+    }
+}
+
+template <IDCTMode kMode>
+SIMD_TARGET("avx2")
+inline void InverseDCTIntegerAVX2(const Block& block, uint8_t* output, size_t stride) {
+    __v8si rows[BLOCK_SIZE];
+    for (size_t y = 0; y < BLOCK_SIZE; ++y) {
+        rows[y] = (__v8si)_mm256_loadu_si256(reinterpret_cast<const __m256i*>(block[y].data()));
+    }
+    IntegerIDCTPass<kMode, false>(rows);
+    Transpose8x8AVX2(rows);
+    IntegerIDCTPass<kMode, true>(rows);
+    Transpose8x8AVX2(rows);
+    for (size_t y = 0; y < BLOCK_SIZE; ++y) {
+        auto samples = (__m256i)rows[y];
+        auto words = _mm_packs_epi32(_mm256_castsi256_si128(samples),
+                                     _mm256_extracti128_si256(samples, 1));
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(&output[y * stride]),
+                         _mm_packus_epi16(words, words));
+    }
+}
+
+inline void InverseDCTRowAccurateSSE4(const Block* blocks, size_t count,
+                                      const Block& quantization_table, uint8_t* output,
+                                      size_t stride) {
+    InverseDCTRowWith<InverseDCTIntegerSSE4<IDCTMode::kAccurate>, InverseDCTOfIntegerDC<3>>(
+            blocks, count, quantization_table, output, stride);
+}
+
+inline void InverseDCTRowFastSSE4(const Block* blocks, size_t count,
+                                  const Block& quantization_table, uint8_t* output,
+                                  size_t stride) {
+    InverseDCTRowWith<InverseDCTIntegerSSE4<IDCTMode::kFast>, InverseDCTOfIntegerDC<5>>(
+            blocks, count, quantization_table, output, stride);
+}
+
+inline void InverseDCTRowAccurateAVX2(const Block* blocks, size_t count,
+                                      const Block& quantization_table, uint8_t* output,
+                                      size_t stride) {
+    InverseDCTRowWith<InverseDCTIntegerAVX2<IDCTMode::kAccurate>, InverseDCTOfIntegerDC<3>>(
+            blocks, count, quantization_table, output, stride);
+}
+
+inline void InverseDCTRowFastAVX2(const Block* blocks, size_t count,
+                                  const Block& quantization_table, uint8_t* output,
+                                  size_t stride) {
+    InverseDCTRowWith<InverseDCTIntegerAVX2<IDCTMode::kFast>, InverseDCTOfIntegerDC<5>>(
+            blocks, count, quantization_table, output, stride);
+}
+
+/* Only doubling is vectorized, which is what 4:2:2 and 4:2:0 need */
+SIMD_TARGET("sse4.1")
+inline void UpsampleRowSSE4(const uint8_t* input, size_t h, size_t h_max, size_t width,
+                            uint8_t* output) {
+    if (h_max != 2 * h) {
+        UpsampleRow(input, h, h_max, width, output);
+        return;
+    }
+    size_t x = 0;
+    for (; x + 32 <= width; x += 32) {
+        auto samples = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&input[x / 2]));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(&output[x]),
+                         _mm_unpacklo_epi8(samples, samples));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(&output[x + 16]),
+                         _mm_unpackhi_epi8(samples, samples));
+    }
+    for (; x < width; ++x) {
+        output[x] = input[x / 2];
+    }
+}
+
+SIMD_TARGET("avx2")
+inline void UpsampleRowAVX2(const uint8_t* input, size_t h, size_t h_max, size_t width,
+                            uint8_t* output) {
+    if (h_max != 2 * h) {
+        UpsampleRow(input, h, h_max, width, output);
+        return;
+    }
+    size_t x = 0;
+    for (; x + 64 <= width; x += 64) {
+        auto samples = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&input[x / 2]));
+        /* Unpacking works within 128-bit lanes, so quarters go 0 2 1 3 first */
+        samples = _mm256_permute4x64_epi64(samples, 0xD8);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(&output[x]),
+                            _mm256_unpacklo_epi8(samples, samples));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(&output[x + 32]),
+                            _mm256_unpackhi_epi8(samples, samples));
+    }
+    for (; x < width; ++x) {
+        output[x] = input[x / 2];
+    }
+}
+
+/* Same fixed point as YCbCrToRGB, lanes are stored through arrays since RGB holds ints */
+template <size_t kLanes>
+inline void StoreRGB(const int32_t* r, const int32_t* g, const int32_t* b, RGB* output) {
+    for (size_t i = 0; i < kLanes; ++i) {
+        output[i] = {r[i], g[i], b[i]};
+    }
+}
+
+/* Clamped luma + ((products + 0.5) >> 16) */
+SIMD_TARGET("sse4.1")
+inline void StoreChannelSSE4(__m128i luma, __m128i products, int32_t* output) {
+    auto value = _mm_add_epi32(luma, _mm_srai_epi32(
+            _mm_add_epi32(products, _mm_set1_epi32(32768)), 16));
+    value = _mm_min_epi32(_mm_max_epi32(value, _mm_setzero_si128()), _mm_set1_epi32(255));
+    _mm_store_si128(reinterpret_cast<__m128i*>(output), value);
+}
+
+SIMD_TARGET("sse4.1")
+inline __m128i LoadSamplesSSE4(const uint8_t* samples) {
+    int32_t word;
+    std::memcpy(&word, samples, sizeof(word));
+    return _mm_cvtepu8_epi32(_mm_cvtsi32_si128(word));
+}
+
+SIMD_TARGET("sse4.1")
+inline void ConvertRowSSE4(const uint8_t* y, const uint8_t* cb, const uint8_t* cr, size_t width,
+                           RGB* output) {
+    auto center = _mm_set1_epi32(128);
+    size_t x = 0;
+    for (; x + 4 <= width; x += 4) {
+        auto luma = LoadSamplesSSE4(&y[x]);
+        auto blue = _mm_sub_epi32(LoadSamplesSSE4(&cb[x]), center);
+        auto red = _mm_sub_epi32(LoadSamplesSSE4(&cr[x]), center);
+        alignas(16) int32_t r[4], g[4], b[4];
+        StoreChannelSSE4(luma, _mm_mullo_epi32(red, _mm_set1_epi32(91881)), r);
+        StoreChannelSSE4(luma, _mm_add_epi32(_mm_mullo_epi32(blue, _mm_set1_epi32(-22554)),
+                                             _mm_mullo_epi32(red, _mm_set1_epi32(-46802))), g);
+        StoreChannelSSE4(luma, _mm_mullo_epi32(blue, _mm_set1_epi32(116130)), b);
+        StoreRGB<4>(r, g, b, &output[x]);
+    }
+    ConvertRow(&y[x], &cb[x], &cr[x], width - x, &output[x]);
+}
+
+SIMD_TARGET("avx2")
+inline void StoreChannelAVX2(__m256i luma, __m256i products, int32_t* output) {
+    auto value = _mm256_add_epi32(luma, _mm256_srai_epi32(
+            _mm256_add_epi32(products, _mm256_set1_epi32(32768)), 16));
+    value = _mm256_min_epi32(_mm256_max_epi32(value, _mm256_setzero_si256()),
+                             _mm256_set1_epi32(255));
+    _mm256_store_si256(reinterpret_cast<__m256i*>(output), value);
+}
+
+SIMD_TARGET("avx2")
+inline __m256i LoadSamplesAVX2(const uint8_t* samples) {
+    return _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(samples)));
+}
+
+SIMD_TARGET("avx2")
+inline void ConvertRowAVX2(const uint8_t* y, const uint8_t* cb, const uint8_t* cr, size_t width,
+                           RGB* output) {
+    auto center = _mm256_set1_epi32(128);
+    size_t x = 0;
+    for (; x + 8 <= width; x += 8) {
+        auto luma = LoadSamplesAVX2(&y[x]);
+        auto blue = _mm256_sub_epi32(LoadSamplesAVX2(&cb[x]), center);
+        auto red = _mm256_sub_epi32(LoadSamplesAVX2(&cr[x]), center);
+        alignas(32) int32_t r[8], g[8], b[8];
+        StoreChannelAVX2(luma, _mm256_mullo_epi32(red, _mm256_set1_epi32(91881)), r);
+        StoreChannelAVX2(luma, _mm256_add_epi32(
+                _mm256_mullo_epi32(blue, _mm256_set1_epi32(-22554)),
+                _mm256_mullo_epi32(red, _mm256_set1_epi32(-46802))), g);
+        StoreChannelAVX2(luma, _mm256_mullo_epi32(blue, _mm256_set1_epi32(116130)), b);
+        StoreRGB<8>(r, g, b, &output[x]);
+    }
+    ConvertRow(&y[x], &cb[x], &cr[x], width - x, &output[x]);
+}
+
+SIMD_TARGET("avx512f")
+inline void StoreChannelAVX512(__m512i luma, __m512i products, int32_t* output) {
+    auto value = _mm512_add_epi32(luma, _mm512_srai_epi32(
+            _mm512_add_epi32(products, _mm512_set1_epi32(32768)), 16));
+    value = _mm512_min_epi32(_mm512_max_epi32(value, _mm512_setzero_si512()),
+                             _mm512_set1_epi32(255));
+    _mm512_store_si512(output, value);
+}
+
+SIMD_TARGET("avx512f")
+inline __m512i LoadSamplesAVX512(const uint8_t* samples) {
+    return _mm512_cvtepu8_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(samples)));
+}
+
+SIMD_TARGET("avx512f")
+inline void ConvertRowAVX512(const uint8_t* y, const uint8_t* cb, const uint8_t* cr, size_t width,
+                             RGB* output) {
+    auto center = _mm512_set1_epi32(128);
+    size_t x = 0;
+    for (; x + 16 <= width; x += 16) {
+        auto luma = LoadSamplesAVX512(&y[x]);
+        auto blue = _mm512_sub_epi32(LoadSamplesAVX512(&cb[x]), center);
+        auto red = _mm512_sub_epi32(LoadSamplesAVX512(&cr[x]), center);
+        alignas(64) int32_t r[16], g[16], b[16];
+        StoreChannelAVX512(luma, _mm512_mullo_epi32(red, _mm512_set1_epi32(91881)), r);
+        StoreChannelAVX512(luma, _mm512_add_epi32(
+                _mm512_mullo_epi32(blue, _mm512_set1_epi32(-22554)),
+                _mm512_mullo_epi32(red, _mm512_set1_epi32(-46802))), g);
+        StoreChannelAVX512(luma, _mm512_mullo_epi32(blue, _mm512_set1_epi32(116130)), b);
+        StoreRGB<16>(r, g, b, &output[x]);
+    }
+    ConvertRow(&y[x], &cb[x], &cr[x], width - x, &output[x]);
+}
+
+/* 16 bytes compared at a time, a bit of the mask per byte */
+SIMD_TARGET("sse4.1")
+inline size_t FindMarkerByteSSE4(const uint8_t* data, size_t size) {
+    auto marker = _mm_set1_epi8(static_cast<char>(0xFF));
+    size_t i = 0;
+    for (; i + 16 <= size; i += 16) {
+        auto bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&data[i]));
+        if (auto mask = _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, marker))) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return i + FindMarkerByte(&data[i], size - i);
+}
+
+SIMD_TARGET("avx2")
+inline size_t FindMarkerByteAVX2(const uint8_t* data, size_t size) {
+    auto marker = _mm256_set1_epi8(static_cast<char>(0xFF));
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32) {
+        auto bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&data[i]));
+        if (auto mask = static_cast<uint32_t>(
+                    _mm256_movemask_epi8(_mm256_cmpeq_epi8(bytes, marker)))) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return i + FindMarkerByteSSE4(&data[i], size - i);
+}
+
+#undef SIMD_TARGET
+
+#endif
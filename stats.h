@@ -0,0 +1,48 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+/* Filled by Decode when asked for. Decodes without stats run code compiled without the counters. */
+struct DecodeStats {
+    enum Stage {
+        /* Everything else: marker segments, frame allocation, file reads outside scans */
+        kMarkers,
+        kEntropy,
+        /* Summed over the workers when DecoderContext::threads > 1 */
+        kIDCT,
+        kColor,
+        kStages
+    };
+
+    using Clock = std::chrono::steady_clock;
+
+    std::array<uint64_t, kStages> nanoseconds{};
+
+    uint64_t bytes = 0;
+    uint64_t blocks = 0;
+    uint64_t dc_only_blocks = 0;
+
+    /* Zigzag position of EOB, 64 for blocks coded up to the last coefficient */
+    std::array<uint64_t, 65> eob_histogram{};
+
+    uint64_t restarts = 0;
+
+    /* Heap allocations of the context arena */
+    uint64_t allocations = 0;
+
+    void AddTime(Stage stage, Clock::time_point start) {
+        nanoseconds[stage] += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                Clock::now() - start).count();
+    }
+
+    uint64_t TotalNanoseconds() const {
+        uint64_t total = 0;
+        for (auto stage : nanoseconds) {
+            total += stage;
+        }
+        return total;
+    }
+};
@@ -1,4 +1,42 @@
 #include "decoder.h"
+#include "pyramid.h"
+
+#include <atomic>
+#include <cstdlib>
+#include <filesystem>
+#include <new>
+
+/* Every global operator new of the process, decoding with a reused context must not add any */
+std::atomic<size_t> operator_new_calls{0};
+
+void* operator new(size_t size) {
+    ++operator_new_calls;
+    if (auto pointer = std::malloc(size ? size : 1)) {
+        return pointer;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void* pointer) noexcept {
+    std::free(pointer);
+}
+
+void operator delete(void* pointer, size_t) noexcept {
+    std::free(pointer);
+}
+
+/* Rows of image match those of expected from top on */
+void ExpectSameImage(const Image& image, const Image& expected, size_t top = 0) {
+    ASSERT(image.Width() == expected.Width() && top + image.Height() <= expected.Height());
+    for (size_t y = 0; y < image.Height(); ++y) {
+        for (size_t x = 0; x < image.Width(); ++x) {
+            auto pixel = image.GetPixel(y, x);
+            auto expected_pixel = expected.GetPixel(top + y, x);
+            ASSERT(pixel.r == expected_pixel.r && pixel.g == expected_pixel.g
+                   && pixel.b == expected_pixel.b);
+        }
+    }
+}
 
 void Decoder::RunTests() {
     auto decoder = Decoder(File("../tests/bad_quality.jpg"));
@@ -18,7 +56,7 @@ void Decoder::RunTests() {
 
     TEST("DQT DC table", [&]() -> void {
         decoder.DQT();
-        std::vector<std::vector<int>> DC_TABLE = {
+        Block DC_TABLE = {{
                 {80,  55,  50,  80, 120, 200, 255, 255},
                 {60,  60,  70,  95, 130, 255, 255, 255},
                 {70,  65,  80, 120, 200, 255, 255, 255},
@@ -27,13 +65,13 @@ void Decoder::RunTests() {
                 {120, 175, 255, 255, 255, 255, 255, 255},
                 {245, 255, 255, 255, 255, 255, 255, 255},
                 {255, 255, 255, 255, 255, 255, 255, 255}
-        };
+        }};
         ASSERT(decoder.quantification_tables_[DC] == DC_TABLE);
     });
 
     TEST("DQT AC table", [&]() -> void {
         decoder.DQT();
-        std::vector<std::vector<int>> AC_TABLE = {
+        Block AC_TABLE = {{
                 {85,  90, 120, 235, 255, 255, 255, 255},
                 {90, 105, 130, 255, 255, 255, 255, 255},
                 {120, 130, 255 ,255, 255, 255, 255, 255},
@@ -42,7 +80,7 @@ void Decoder::RunTests() {
                 {255, 255, 255, 255, 255, 255, 255, 255},
                 {255, 255, 255, 255, 255, 255, 255, 255},
                 {255, 255, 255, 255, 255, 255, 255, 255}
-        };
+        }};
         ASSERT(decoder.quantification_tables_[AC] == AC_TABLE);
     });
 
@@ -57,46 +95,30 @@ void Decoder::RunTests() {
 
     TEST("DHT DC0", [&]() -> void {
         decoder.DHT();
-        std::vector<std::list<uint8_t>> DC0_table = {
-                {0},
-                {1},
-                {2},
-                {3},
-                {4},
-                {5},
-                {},
-                {},
-                {},
-                {},
-                {},
-                {},
-                {},
-                {},
-                {},
-                {},
+        HuffmanTable DC0_table = {
+                {1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0},
+                {0, 1, 2, 3, 4, 5}
         };
         ASSERT(decoder.tables_[DC][0] == DC0_table);
     });
 
     TEST("DHT AC0", [&]() -> void {
         decoder.DHT();
-        std::vector<std::list<uint8_t>> AC0_table = {
-                {0x00},
-                {0x01},
-                {},
-                {0x02, 0x11},
-                {0x31, 0x41},
-                {0x12, 0x21},
-                {0x03, 0x51},
-                {0x22, 0x61},
-                {0x13, 0x71},
-                {0x32, 0x52},
-                {0x42, 0x91},
-                {0x04, 0x62, 0x81},
-                {},
-                {0x82, 0xA1, 0xB1},
-                {0xE1},
-                {},
+        HuffmanTable AC0_table = {
+                {1, 1, 0, 2, 2, 2, 2, 2, 2, 2, 2, 3, 0, 3, 1, 0},
+                {0x00,
+                 0x01,
+                 0x02, 0x11,
+                 0x31, 0x41,
+                 0x12, 0x21,
+                 0x03, 0x51,
+                 0x22, 0x61,
+                 0x13, 0x71,
+                 0x32, 0x52,
+                 0x42, 0x91,
+                 0x04, 0x62, 0x81,
+                 0x82, 0xA1, 0xB1,
+                 0xE1}
         };
         ASSERT(decoder.tables_[AC][0] == AC0_table);
     });
@@ -157,17 +179,16 @@ void Decoder::RunTests() {
                 throw std::runtime_error("Wrong component id");
             }
             --component_id;
-            google_img1.components_[component_id].trees.resize(2);
             auto DC_table_id = google_img1.file_.GetHalfByte();
             google_img1.AssertBit(DC_table_id);
-            google_img1.components_[component_id].trees[DC] = google_img1.trees_[DC][DC_table_id];
+            google_img1.components_[component_id].decoders[DC] = google_img1.decoders_[DC][DC_table_id];
             auto AC_table_id = google_img1.file_.GetHalfByte();
             google_img1.AssertBit(DC_table_id);
-            google_img1.components_[component_id].trees[AC] = google_img1.trees_[AC][AC_table_id];
+            google_img1.components_[component_id].decoders[AC] = google_img1.decoders_[AC][AC_table_id];
         }
 
         for (size_t i = 0; i < 3; ++i) {
-            if (google_img1.components_[i].trees.empty()) {
+            if (!google_img1.components_[i].decoders[DC]) {
                 throw std::runtime_error("Same components are detected");
             }
             google_img1.file_.GetByte();
@@ -181,13 +202,12 @@ void Decoder::RunTests() {
         auto number_of_Y_components_v = google_img1.GetNumberOfComponentsByOneDimension(
                 google_img1.image_.Height(), google_img1.vth_max);
 
-        std::vector<std::vector<int>> Y;
+        Block Y;
         for (size_t i = 0; i < number_of_Y_components_h; ++i) {
             for (size_t j = 0; j < number_of_Y_components_v; ++j) {
                 for (size_t i_1 = 0; i_1 < google_img1.components_[0].vth; ++i_1) {
                     for (size_t j_1 = 0; j_1 < google_img1.components_[0].hth; ++j_1) {
-                        Y.clear();
-                        Y.resize(8, std::vector<int>(8));
+                        Y = Block{};
                         google_img1.ReadDC(Y, 0);
                         google_img1.ReadAC(Y, 0);
                         google_img1.Dequant(Y, google_img1.components_[0].qt_id);
@@ -196,7 +216,7 @@ void Decoder::RunTests() {
             }
         }
 
-        ASSERT(Y == std::vector<std::vector<int>>{
+        ASSERT(Y == Block{{
                 {-160, 220, 200, 160, 0, 0, 0, 0},
                 {-120, 0, -140, 0, 0, 0, 0, 0},
                 {-140, -130, 0, 0, 0, 0, 0, 0},
@@ -205,7 +225,318 @@ void Decoder::RunTests() {
                 {0, 0, 0, 0, 0, 0, 0, 0},
                 {0, 0, 0, 0, 0, 0, 0, 0},
                 {0, 0, 0, 0, 0, 0, 0, 0}
-        });
+        }});
+    });
+
+    TEST("Decoder context reuse", [&]() -> void {
+        DecoderContext context;
+        ASSERT(Decode("../tests/bad_quality.jpg", &context).GetComment() == "so quality");
+        auto capacity = context.arena.Capacity();
+        auto& image = Decode("../tests/lenna.jpg", &context);
+        ASSERT(image.GetComment().empty());
+        ASSERT(image.Width() == 512 && image.Height() == 512);
+        ASSERT(Decode("../tests/bad_quality.jpg", &context).Width() == 990);
+        ASSERT(context.arena.Capacity() >= capacity);
+        capacity = context.arena.Capacity();
+        Decode("../tests/lenna.jpg", &context);
+        ASSERT(context.arena.Capacity() == capacity);
+        for (const std::string filename : {"../tests/lenna.jpg", "../tests/bad_quality.jpg"}) {
+            Decode(filename, &context);
+            size_t calls = operator_new_calls;
+            Decode(filename, &context);
+            ASSERT(operator_new_calls == calls);
+        }
+    });
+
+    TEST("Huffman decoder cache", [&]() -> void {
+        auto& cache = HuffmanDecoderCache::Instance();
+        Decode("../tests/lenna.jpg");
+        auto size = cache.Size();
+        Decode("../tests/lenna.jpg");
+        ASSERT(cache.Size() == size);
+        ASSERT(cache.Get(decoder.tables_[DC][0]) == cache.Get(decoder.tables_[DC][0]));
+    });
+
+    TEST("Standard Huffman tables", [&]() -> void {
+        auto standard = Decoder(File("../tests/test.jpg"));
+        standard.Parse();
+        ASSERT(standard.components_[0].standard_tables == StandardTables::kLuminance);
+        ASSERT(standard.components_[1].standard_tables == StandardTables::kChrominance);
+        ASSERT(standard.standard_tables_[DC][0] == StandardTables::kLuminance);
+        ASSERT(decoder.standard_tables_[DC][0] == StandardTables::kNone);
+    });
+
+    TEST("Decode stats", [&]() -> void {
+        DecoderContext context;
+        DecodeStats stats;
+        Decode("../tests/lenna.jpg", &context, &stats);
+        ASSERT(stats.blocks == 3 * 64 * 64);
+        uint64_t histogram_blocks = 0;
+        for (auto count : stats.eob_histogram) {
+            histogram_blocks += count;
+        }
+        ASSERT(histogram_blocks == stats.blocks);
+        ASSERT(stats.dc_only_blocks <= stats.blocks);
+        ASSERT(stats.bytes == 407462);
+        ASSERT(stats.restarts == 0);
+        ASSERT(stats.nanoseconds[DecodeStats::kEntropy] > 0);
+        Decode("../tests/lenna.jpg", &context, &stats);
+        ASSERT(stats.allocations == 0);
+    });
+
+    TEST("Decode from memory with limits", [&]() -> void {
+        std::ifstream input("../tests/bad_quality.jpg", std::ios::binary);
+        std::vector<uint8_t> data((std::istreambuf_iterator<char>(input)),
+                                  std::istreambuf_iterator<char>());
+        DecoderContext context;
+        auto& image = Decode(data.data(), data.size(), &context);
+        ASSERT(image.Width() == 990 && image.GetComment() == "so quality");
+
+        auto expect_fail = [&](const DecodeLimits& limits) {
+            context.limits = limits;
+            bool failed = false;
+            try {
+                Decode(data.data(), data.size(), &context);
+            } catch (const std::runtime_error&) {
+                failed = true;
+            }
+            ASSERT(failed);
+        };
+        DecodeLimits limits;
+        limits.max_pixels = 990 * 560 - 1;
+        expect_fail(limits);
+        limits = DecodeLimits();
+        limits.max_memory = 1 << 20;
+        expect_fail(limits);
+        limits = DecodeLimits();
+        limits.max_time = std::chrono::nanoseconds(1);
+        expect_fail(limits);
+    });
+
+    TEST("Tolerant decode of damaged data", [&]() -> void {
+        std::ifstream input("../tests/lenna.jpg", std::ios::binary);
+        std::vector<uint8_t> data((std::istreambuf_iterator<char>(input)),
+                                  std::istreambuf_iterator<char>());
+        DecoderContext context;
+        auto expected = Decode(data.data(), data.size(), &context);
+        ASSERT(!context.damaged);
+
+        auto truncated = std::vector<uint8_t>(data.begin(), data.begin() + data.size() / 2);
+        bool failed = false;
+        try {
+            Decode(truncated.data(), truncated.size(), &context);
+        } catch (const std::runtime_error&) {
+            failed = true;
+        }
+        ASSERT(failed);
+
+        context.tolerant = true;
+        auto& image = Decode(truncated.data(), truncated.size(), &context);
+        ASSERT(context.damaged && image.Width() == expected.Width());
+        auto same_corner = [&]() {
+            auto pixel = image.GetPixel(0, 0);
+            auto expected_pixel = expected.GetPixel(0, 0);
+            return pixel.r == expected_pixel.r && pixel.g == expected_pixel.g
+                   && pixel.b == expected_pixel.b;
+        };
+        ASSERT(same_corner());
+        auto gray = image.GetPixel(image.Height() - 1, image.Width() - 1);
+        ASSERT(gray.r == 128 && gray.g == 128 && gray.b == 128);
+
+        auto corrupted = data;
+        std::fill(corrupted.begin() + data.size() / 2, corrupted.begin() + data.size() / 2 + 64,
+                  0xA5);
+        Decode(corrupted.data(), corrupted.size(), &context);
+        ASSERT(context.damaged && same_corner());
+    });
+
+    TEST("Decode without exceptions", [&]() -> void {
+        std::ifstream input("../tests/lenna.jpg", std::ios::binary);
+        std::vector<uint8_t> data((std::istreambuf_iterator<char>(input)),
+                                  std::istreambuf_iterator<char>());
+        DecoderContext context;
+        auto result = TryDecode(data.data(), data.size(), &context);
+        ASSERT(result && result->Width() == 512);
+
+        result = TryDecode(data.data(), data.size() / 2, &context);
+        ASSERT(!result && result.error() == DecodeError::kUnexpectedEOF);
+        result = TryDecode(data.data() + 1, data.size() - 1, &context);
+        ASSERT(!result && result.error() == DecodeError::kBadFile);
+        context.limits.max_pixels = 1;
+        result = TryDecode(data.data(), data.size(), &context);
+        ASSERT(!result && result.error() == DecodeError::kLimitExceeded);
     });
 
+    TEST("Pipelined decode", [&]() -> void {
+        DecoderContext context;
+        context.threads = 4;
+        for (const std::string filename : {"../tests/lenna.jpg", "../tests/grayscale.jpg",
+                                           "../tests/chroma_halfed.jpg"}) {
+            DecoderContext expected_context;
+            DecodeStats expected_stats;
+            auto& expected = Decode(filename, &expected_context, &expected_stats);
+            DecodeStats stats;
+            auto& image = Decode(filename, &context, &stats);
+            ASSERT(image.Height() == expected.Height());
+            ExpectSameImage(image, expected);
+            ASSERT(stats.dc_only_blocks == expected_stats.dc_only_blocks);
+            // The workers of the context are kept rather than started again
+            size_t calls = operator_new_calls;
+            ExpectSameImage(Decode(filename, &context), expected);
+            ASSERT(operator_new_calls == calls);
+        }
+    });
+
+    TEST("SIMD kernels match scalar ones", [&]() -> void {
+        std::vector<std::string> filenames;
+        for (auto&& entry : std::filesystem::directory_iterator("../tests")) {
+            if (entry.path().extension() == ".jpg") {
+                filenames.push_back(entry.path().string());
+            }
+        }
+        auto bound = GetKernels().level;
+        for (auto&& filename : filenames) {
+            for (auto mode : {IDCTMode::kFloat, IDCTMode::kAccurate, IDCTMode::kFast}) {
+                DecoderContext context;
+                context.idct_mode = mode;
+                SetCpuLevel(CpuLevel::kScalar);
+                Image expected;
+                try {
+                    expected = Decode(filename, &context);
+                } catch (const std::runtime_error&) {
+                    continue;
+                }
+                for (auto level : {CpuLevel::kSSE4, CpuLevel::kAVX2, CpuLevel::kAVX512}) {
+                    if (level > DetectCpuLevel()) {
+                        break;
+                    }
+                    SetCpuLevel(level);
+                    ExpectSameImage(Decode(filename, &context), expected);
+                }
+            }
+        }
+        SetCpuLevel(bound);
+    });
+
+    TEST("Decoding rows from an index", [&]() -> void {
+        for (auto filename : {"../tests/lenna.jpg", "../tests/test.jpg",
+                              "../tests/grayscale.jpg"}) {
+            DecoderContext context;
+            auto index = EntropyIndex::Deserialize(
+                    BuildEntropyIndex(filename, 3, &context).Serialize());
+            auto expected = context.image;
+            ASSERT(index.checkpoints.size() > 1 && index.checkpoints[1].mcu_row == 3);
+            size_t height = expected.Height();
+            for (auto band : {std::pair<size_t, size_t>{0, height}, {height / 2, 1},
+                              {height / 3, height / 4}, {height - 5, 5}}) {
+                auto& image = DecodeRows(filename, index, band.first, band.second, &context);
+                ASSERT(image.Height() == band.second);
+                ExpectSameImage(image, expected, band.first);
+            }
+        }
+    });
+
+    TEST("Index from restart markers", [&]() -> void {
+        DecoderContext context;
+        auto expected = Decode("../tests/restarts.jpg");
+        auto index = BuildRestartMarkerIndex("../tests/restarts.jpg", 4, &context);
+        ASSERT(index.checkpoints.size() == 8 && index.checkpoints[1].mcu_row == 4);
+        ASSERT(context.image.Width() == 0);
+        for (size_t y = 0; y < expected.Height(); y += 64) {
+            ExpectSameImage(DecodeRows("../tests/restarts.jpg", index, y, 64, &context), expected,
+                            y);
+        }
+        bool failed = false;
+        try {
+            BuildRestartMarkerIndex("../tests/lenna.jpg", 4, &context);
+        } catch (const std::runtime_error&) {
+            failed = true;
+        }
+        ASSERT(failed);
+    });
+
+    TEST("Tile pyramid", [&]() -> void {
+        for (auto filename : {"../tests/lenna.jpg", "../tests/chroma_halfed.jpg"}) {
+            // Every level above the image is its 2x2 average, the last column or row of an odd
+            // size is paired with itself
+            std::vector<Image> expected(1, Decode(filename));
+            while (expected.back().Width() > 1 || expected.back().Height() > 1) {
+                auto& larger = expected.back();
+                Image level((larger.Width() + 1) / 2, (larger.Height() + 1) / 2);
+                for (size_t y = 0; y < level.Height(); ++y) {
+                    size_t bottom = std::min(2 * y + 1, larger.Height() - 1);
+                    for (size_t x = 0; x < level.Width(); ++x) {
+                        size_t right = std::min(2 * x + 1, larger.Width() - 1);
+                        std::array<RGB, 4> pixels = {
+                                larger.GetPixel(2 * y, 2 * x), larger.GetPixel(2 * y, right),
+                                larger.GetPixel(bottom, 2 * x), larger.GetPixel(bottom, right)};
+                        auto average = [&](int RGB::*channel) {
+                            int sum = 2;
+                            for (auto&& pixel : pixels) {
+                                sum += pixel.*channel;
+                            }
+                            return sum / 4;
+                        };
+                        level.SetPixel(y, x, {average(&RGB::r), average(&RGB::g),
+                                              average(&RGB::b)});
+                    }
+                }
+                expected.push_back(std::move(level));
+            }
+            std::reverse(expected.begin(), expected.end());
+
+            PyramidOptions options;
+            options.tile_size = 100;
+            std::vector<size_t> tiles(expected.size());
+            std::vector<Image> images;
+            for (auto&& level : expected) {
+                images.emplace_back(level.Width(), level.Height());
+            }
+            DecoderContext context;
+            DecodePyramid(filename, options, [&](size_t level, size_t column, size_t row,
+                                                 const Image& tile) {
+                ASSERT(level < images.size());
+                ++tiles[level];
+                size_t left = column ? column * 100 - 1 : 0;
+                size_t top = row ? row * 100 - 1 : 0;
+                for (size_t y = 0; y < tile.Height(); ++y) {
+                    for (size_t x = 0; x < tile.Width(); ++x) {
+                        images[level].SetPixel(top + y, left + x, tile.GetPixel(y, x));
+                    }
+                }
+            }, &context);
+            ASSERT(context.image.Height() < expected.back().Height());
+            for (size_t level = 0; level < images.size(); ++level) {
+                size_t columns = (images[level].Width() + 99) / 100;
+                size_t rows = (images[level].Height() + 99) / 100;
+                ASSERT(tiles[level] == columns * rows);
+                ExpectSameImage(images[level], expected[level]);
+            }
+        }
+    });
+
+    TEST("Validate", [&]() -> void {
+        std::ifstream input("../tests/lenna.jpg", std::ios::binary);
+        std::vector<uint8_t> data((std::istreambuf_iterator<char>(input)),
+                                  std::istreambuf_iterator<char>());
+        DecoderContext context;
+        context.tolerant = true;
+        ASSERT(Validate(data.data(), data.size(), &context));
+        ASSERT(context.image.Width() == 0);
+
+        auto truncated = std::vector<uint8_t>(data.begin(), data.begin() + data.size() / 2);
+        auto result = Validate(truncated.data(), truncated.size(), &context);
+        ASSERT(result.error == DecodeError::kUnexpectedEOF && result.offset == truncated.size());
+
+        auto corrupted = data;
+        size_t position = data.size() / 3;
+        std::fill(corrupted.begin() + position, corrupted.begin() + position + 64, 0xA5);
+        result = Validate(corrupted.data(), corrupted.size(), &context);
+        ASSERT(!result && result.offset >= position && result.offset < position + 1024);
+
+        for (size_t i = 1; i <= 24; ++i) {
+            auto filename = "../tests/bad/bad" + std::to_string(i) + ".jpg";
+            ASSERT(!Validate(filename, &context));
+        }
+    });
 }
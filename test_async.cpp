@@ -0,0 +1,156 @@
+#include <catch.hpp>
+#include "test_commons.h"
+
+#include <async_decoder.h>
+
+#include <algorithm>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+/* A file handed out chunk by chunk by a single-threaded event loop */
+class ChunkedSource {
+public:
+    ChunkedSource(const std::string& filename, size_t chunk_size)
+            : chunk_size_(chunk_size) {
+        std::ifstream file(filename, std::ios::binary);
+        data_.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    }
+
+    struct ReadAwaiter {
+        bool await_ready() const noexcept {
+            return false;
+        }
+
+        void await_suspend(std::coroutine_handle<> handle) {
+            source->pending_.push_back(handle);
+        }
+
+        size_t await_resume() {
+            size_t count = std::min({size, source->chunk_size_,
+                                     source->data_.size() - source->offset_});
+            std::memcpy(buffer, source->data_.data() + source->offset_, count);
+            source->offset_ += count;
+            return count;
+        }
+
+        ChunkedSource* source;
+        uint8_t* buffer;
+        size_t size;
+    };
+
+    struct YieldAwaiter {
+        bool await_ready() const noexcept {
+            return false;
+        }
+
+        void await_suspend(std::coroutine_handle<> handle) {
+            ++source->yields_;
+            source->pending_.push_back(handle);
+        }
+
+        void await_resume() const noexcept {}
+
+        ChunkedSource* source;
+    };
+
+    ReadAwaiter Read(uint8_t* buffer, size_t size) {
+        return {this, buffer, size};
+    }
+
+    YieldAwaiter Yield() {
+        return {this};
+    }
+
+    void Truncate(size_t size) {
+        data_.resize(size);
+    }
+
+    void RunLoop() {
+        while (!pending_.empty()) {
+            auto handle = pending_.front();
+            pending_.pop_front();
+            handle.resume();
+        }
+    }
+
+    size_t yields_ = 0;
+
+private:
+    std::vector<uint8_t> data_;
+    size_t chunk_size_;
+    size_t offset_ = 0;
+    std::deque<std::coroutine_handle<>> pending_;
+};
+
+DecodeResult DecodeChunked(ChunkedSource* source, DecoderContext* context, size_t rows_per_yield) {
+    auto task = DecodeAsync(*source, context, rows_per_yield);
+    task.Start();
+    source->RunLoop();
+    REQUIRE(task.Done());
+    return task.Result();
+}
+
+TEST_CASE("Decoding chunk by chunk", "[async]") {
+    for (std::string filename : {"lenna.jpg", "test.jpg", "grayscale.jpg", "small.jpg"}) {
+        for (size_t chunk_size : {1, 97, 4096}) {
+            ChunkedSource source("../tests/" + filename, chunk_size);
+            DecoderContext context;
+            auto result = DecodeChunked(&source, &context, 4);
+            REQUIRE(result);
+            RequireSameImage(*result, Decode("../tests/" + filename));
+        }
+    }
+}
+
+TEST_CASE("Yields between MCU rows", "[async]") {
+    ChunkedSource source("../tests/lenna.jpg", 1 << 20);
+    DecoderContext context;
+    REQUIRE(DecodeChunked(&source, &context, 1));
+    /* Once per MCU row, output along with its entropy decoding, less the rows where a read
+     * came first */
+    REQUIRE(source.yields_ > context.image.Height() / 16);
+}
+
+TEST_CASE("Truncated stream", "[async]") {
+    ChunkedSource source("../tests/lenna.jpg", 1000);
+    source.Truncate(20000);
+    DecoderContext context;
+    auto result = DecodeChunked(&source, &context, 16);
+    REQUIRE_FALSE(result);
+    REQUIRE(result.error() == DecodeError::kUnexpectedEOF);
+
+    ChunkedSource tolerant_source("../tests/lenna.jpg", 1000);
+    tolerant_source.Truncate(20000);
+    context.tolerant = true;
+    REQUIRE(DecodeChunked(&tolerant_source, &context, 16));
+    REQUIRE(context.damaged);
+}
+
+DecodeTask DecodeBoth(ChunkedSource* first, ChunkedSource* second, DecoderContext* context,
+                      size_t* width) {
+    auto result = co_await DecodeAsync(*first, context);
+    if (!result) {
+        co_return result;
+    }
+    *width = result->Width();
+    co_return co_await DecodeAsync(*second, context);
+}
+
+TEST_CASE("Awaiting a decode", "[async]") {
+    ChunkedSource first("../tests/lenna.jpg", 5000);
+    ChunkedSource second("../tests/small.jpg", 5000);
+    DecoderContext context;
+    size_t width = 0;
+    auto task = DecodeBoth(&first, &second, &context, &width);
+    task.Start();
+    first.RunLoop();
+    second.RunLoop();
+    REQUIRE(task.Done());
+    REQUIRE(task.Result());
+    REQUIRE(width == 512);
+    REQUIRE(context.image.Width() == Decode("../tests/small.jpg").Width());
+}
@@ -25,6 +25,10 @@ TEST_CASE("exif (grayscale)", "[jpg]") {
     CheckImage("grayscale.jpg");
 }
 
+TEST_CASE("jfif (4:1:1)", "[jpg]") {
+    CheckImage("chroma_quartered.jpg");
+}
+
 TEST_CASE("jfif/exif (4:2:0)", "[jpg]") {
     CheckImage("test.jpg");
 }
@@ -37,6 +41,22 @@ TEST_CASE("photoshop (4:4:4)", "[jpg]") {
     CheckImage("save_for_web.jpg");
 }
 
+TEST_CASE("IDCT modes", "[jpg]") {
+    for (auto mode : {IDCTMode::kFloat, IDCTMode::kAccurate, IDCTMode::kFast}) {
+        DecoderContext context;
+        context.idct_mode = mode;
+        for (std::string filename : {"lenna.jpg", "test.jpg", "grayscale.jpg"}) {
+            Compare(Decode("../tests/" + filename, &context), ReadJpg("../tests/" + filename));
+        }
+    }
+    /* libjpeg decodes with the accurate one, files without subsampling come out the same */
+    DecoderContext context;
+    context.idct_mode = IDCTMode::kAccurate;
+    for (std::string filename : {"lenna.jpg", "colors.jpg", "grayscale.jpg"}) {
+        RequireSameImage(Decode("../tests/" + filename, &context), ReadJpg("../tests/" + filename));
+    }
+}
+
 TEST_CASE("Error handling", "[jpg]") {
     const size_t tests_count = 24;
     for (size_t i = 1; i <= tests_count; ++i) {
@@ -37,6 +37,21 @@ void Compare(const Image& actual, const Image& expected) {
     REQUIRE(mean <= 5);
 }
 
+/* Pixel-exact equality, for paths that must not change a single sample */
+void RequireSameImage(const Image& actual, const Image& expected) {
+    REQUIRE(actual.Width() == expected.Width());
+    REQUIRE(actual.Height() == expected.Height());
+    size_t mismatches = 0;
+    for (size_t y = 0; y < actual.Height(); ++y) {
+        for (size_t x = 0; x < actual.Width(); ++x) {
+            auto lhs = actual.GetPixel(y, x);
+            auto rhs = expected.GetPixel(y, x);
+            mismatches += lhs.r != rhs.r || lhs.g != rhs.g || lhs.b != rhs.b;
+        }
+    }
+    REQUIRE(mismatches == 0);
+}
+
 void CheckImage(
     const std::string& filename,
     const std::string& expected_comment = "",
@@ -0,0 +1,63 @@
+#include <catch.hpp>
+#include "test_commons.h"
+
+#include <transcoder.h>
+
+#include <fstream>
+
+size_t FileSize(const std::string& filename) {
+    std::ifstream file(filename, std::ios::binary | std::ios::ate);
+    return file.tellg();
+}
+
+void CheckLossless(const std::string& actual, const std::string& expected) {
+    RequireSameImage(ReadJpg(actual), ReadJpg(expected));
+}
+
+/* Output size over input size, reported for every file */
+double SizeRatio(const std::string& actual, const std::string& expected) {
+    auto ratio = static_cast<double>(FileSize(actual)) / FileSize(expected);
+    WARN(actual << ": " << FileSize(actual) << " of " << FileSize(expected) << " bytes, ratio "
+                << ratio);
+    return ratio;
+}
+
+void CheckOptimizeHuffman(const std::string& filename, size_t threads = 0) {
+    auto dot_pos = filename.find(".");
+    std::string output(filename.substr(0, dot_pos) + "_optimized.jpg");
+    OptimizeHuffman("../tests/" + filename, output, threads);
+    CheckLossless(output, "../tests/" + filename);
+    REQUIRE(SizeRatio(output, "../tests/" + filename) <= 1);
+}
+
+TEST_CASE("Optimized Huffman tables", "[transcode]") {
+    CheckOptimizeHuffman("small.jpg");
+    CheckOptimizeHuffman("lenna.jpg");
+    CheckOptimizeHuffman("bad_quality.jpg", 3);
+    CheckOptimizeHuffman("chroma_halfed.jpg");
+    CheckOptimizeHuffman("grayscale.jpg", 7);
+    CheckOptimizeHuffman("test.jpg");
+    CheckOptimizeHuffman("colors.jpg");
+    CheckOptimizeHuffman("save_for_web.jpg");
+    CheckOptimizeHuffman("tiny.jpg", 2);
+}
+
+void CheckProgressive(const std::string& filename) {
+    auto dot_pos = filename.find(".");
+    std::string output(filename.substr(0, dot_pos) + "_progressive.jpg");
+    TranscodeToProgressive("../tests/" + filename, output);
+    CheckLossless(output, "../tests/" + filename);
+    SizeRatio(output, "../tests/" + filename);
+}
+
+TEST_CASE("Baseline to progressive", "[transcode]") {
+    CheckProgressive("small.jpg");
+    CheckProgressive("lenna.jpg");
+    CheckProgressive("bad_quality.jpg");
+    CheckProgressive("chroma_halfed.jpg");
+    CheckProgressive("grayscale.jpg");
+    CheckProgressive("test.jpg");
+    CheckProgressive("colors.jpg");
+    CheckProgressive("save_for_web.jpg");
+    CheckProgressive("tiny.jpg");
+}
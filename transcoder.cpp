@@ -0,0 +1,693 @@
+#include "transcoder.h"
+
+#include <fstream>
+#include <iterator>
+#include <limits>
+#include <thread>
+
+namespace {
+
+enum TableType {
+    DC = 0,
+    AC = 1
+};
+
+using TableFrequencies = std::array<std::array<SymbolFrequencies, 2>, 2>;
+
+struct Segment {
+    uint8_t marker;
+    size_t begin;
+    size_t end;
+};
+
+std::vector<uint8_t> ReadFileBytes(const std::string& filename) {
+    std::ifstream file(filename, std::ios::binary);
+    if (!file.is_open()) {
+        throw std::runtime_error("Can not open file!");
+    }
+    return std::vector<uint8_t>(std::istreambuf_iterator<char>(file),
+                                std::istreambuf_iterator<char>());
+}
+
+void WriteFileBytes(const std::string& filename, const std::vector<uint8_t>& data) {
+    std::ofstream file(filename, std::ios::binary);
+    if (!file.is_open()) {
+        throw std::runtime_error("Can not open file for writing " + filename);
+    }
+    file.write(reinterpret_cast<const char*>(data.data()), data.size());
+}
+
+/* Marker segments up to EOI; entropy-coded data after SOS is not included */
+std::vector<Segment> SplitSegments(const std::vector<uint8_t>& data) {
+    std::vector<Segment> segments;
+    size_t pos = 0;
+    while (true) {
+        if (pos + 1 >= data.size() || data[pos] != 0xFF) {
+            throw std::runtime_error("Expected marker");
+        }
+        while (pos + 1 < data.size() && data[pos + 1] == 0xFF) {
+            ++pos;
+        }
+        if (pos + 1 >= data.size()) {
+            throw std::runtime_error("Unexpected EOF!");
+        }
+        uint8_t marker = data[pos + 1];
+        if (marker == 0xD8 || marker == 0xD9) {
+            segments.push_back({marker, pos, pos + 2});
+            pos += 2;
+            if (marker == 0xD9) {
+                return segments;
+            }
+            continue;
+        }
+        if (pos + 3 >= data.size()) {
+            throw std::runtime_error("Unexpected EOF!");
+        }
+        size_t end = pos + 2 + (data[pos + 2] << 8 | data[pos + 3]);
+        if (end > data.size()) {
+            throw std::runtime_error("Unexpected EOF!");
+        }
+        segments.push_back({marker, pos, end});
+        pos = end;
+        if (marker == 0xDA) {
+            while (pos + 1 < data.size() &&
+                   !(data[pos] == 0xFF && data[pos + 1] != 0x00 &&
+                     (data[pos + 1] < 0xD0 || data[pos + 1] > 0xD7))) {
+                ++pos;
+            }
+        }
+    }
+}
+
+struct ScanTables {
+    std::vector<size_t> DC_table_id;
+    std::vector<size_t> AC_table_id;
+
+    ScanTables(const Decoder& decoder, const Decoder::Scan& scan)
+            : DC_table_id(decoder.GetComponents().size())
+            , AC_table_id(decoder.GetComponents().size()) {
+        for (auto&& scan_component : scan.components) {
+            DC_table_id[scan_component.component] = scan_component.DC_table_id;
+            AC_table_id[scan_component.component] = scan_component.AC_table_id;
+        }
+    }
+};
+
+void GatherRows(const Decoder& decoder, const Decoder::Scan& scan,
+                size_t row_begin, size_t row_end, TableFrequencies* frequencies) {
+    const auto& components = decoder.GetComponents();
+    auto restart_interval = decoder.GetRestartInterval();
+    ScanTables tables(decoder, scan);
+
+    /* DC is predicted from the last block of the previous MCU in coding order */
+    std::vector<int> last_DC(components.size());
+    if (row_begin) {
+        decoder.ForEachBlockOfMCU(scan, row_begin - 1, scan.mcus_h - 1,
+                                  [&](size_t component, size_t block) {
+            last_DC[component] = components[component].blocks[block][0][0];
+        });
+    }
+
+    for (size_t mcu_y = row_begin; mcu_y < row_end; ++mcu_y) {
+        for (size_t mcu_x = 0; mcu_x < scan.mcus_h; ++mcu_x) {
+            size_t mcu = mcu_y * scan.mcus_h + mcu_x;
+            if (restart_interval && mcu % restart_interval == 0) {
+                std::fill(last_DC.begin(), last_DC.end(), 0);
+            }
+            decoder.ForEachBlockOfMCU(scan, mcu_y, mcu_x, [&](size_t component, size_t block) {
+                const auto& coefs = components[component].blocks[block];
+                auto& DC_frequencies = (*frequencies)[DC][tables.DC_table_id[component]];
+                auto& AC_frequencies = (*frequencies)[AC][tables.AC_table_id[component]];
+                EmitBlock(coefs, last_DC[component],
+                          [&](uint8_t symbol, uint32_t, size_t) { ++DC_frequencies[symbol]; },
+                          [&](uint8_t symbol, uint32_t, size_t) { ++AC_frequencies[symbol]; });
+                last_DC[component] = coefs[0][0];
+            });
+        }
+    }
+}
+
+void GatherStatistics(const Decoder& decoder, const Decoder::Scan& scan,
+                      size_t threads, TableFrequencies* frequencies) {
+    if (!threads) {
+        threads = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+    }
+    threads = std::max<size_t>(std::min(threads, scan.mcus_v), 1);
+
+    std::vector<TableFrequencies> partial(threads);
+    std::vector<std::thread> workers;
+    for (size_t i = 0; i < threads; ++i) {
+        size_t row_begin = scan.mcus_v * i / threads;
+        size_t row_end = scan.mcus_v * (i + 1) / threads;
+        workers.emplace_back(GatherRows, std::cref(decoder), std::cref(scan),
+                             row_begin, row_end, &partial[i]);
+    }
+    for (auto&& worker : workers) {
+        worker.join();
+    }
+
+    for (auto&& part : partial) {
+        for (size_t type = 0; type < 2; ++type) {
+            for (size_t id = 0; id < 2; ++id) {
+                for (size_t symbol = 0; symbol < 256; ++symbol) {
+                    (*frequencies)[type][id][symbol] += part[type][id][symbol];
+                }
+            }
+        }
+    }
+}
+
+void EncodeScan(const Decoder& decoder, const Decoder::Scan& scan,
+                const std::array<std::array<HuffmanEncoder, 2>, 2>& encoders,
+                std::vector<uint8_t>* output) {
+    const auto& components = decoder.GetComponents();
+    auto restart_interval = decoder.GetRestartInterval();
+    ScanTables tables(decoder, scan);
+    BitWriter writer(output);
+
+    std::vector<int> last_DC(components.size());
+    size_t restarts = 0;
+    for (size_t mcu_y = 0; mcu_y < scan.mcus_v; ++mcu_y) {
+        for (size_t mcu_x = 0; mcu_x < scan.mcus_h; ++mcu_x) {
+            size_t mcu = mcu_y * scan.mcus_h + mcu_x;
+            if (restart_interval && mcu && mcu % restart_interval == 0) {
+                writer.PutMarker(0xD0 + restarts++ % 8);
+                std::fill(last_DC.begin(), last_DC.end(), 0);
+            }
+            decoder.ForEachBlockOfMCU(scan, mcu_y, mcu_x, [&](size_t component, size_t block) {
+                const auto& coefs = components[component].blocks[block];
+                const auto& DC_encoder = encoders[DC][tables.DC_table_id[component]];
+                const auto& AC_encoder = encoders[AC][tables.AC_table_id[component]];
+                EmitBlock(coefs, last_DC[component],
+                          [&](uint8_t symbol, uint32_t bits, size_t size) {
+                              DC_encoder.Encode(&writer, symbol);
+                              writer.PutBits(bits, size);
+                          },
+                          [&](uint8_t symbol, uint32_t bits, size_t size) {
+                              AC_encoder.Encode(&writer, symbol);
+                              writer.PutBits(bits, size);
+                          });
+                last_DC[component] = coefs[0][0];
+            });
+        }
+    }
+    writer.Flush();
+}
+
+bool IsUsed(const SymbolFrequencies& frequencies) {
+    return std::any_of(frequencies.begin(), frequencies.end(),
+                       [](uint64_t frequency) { return frequency != 0; });
+}
+
+void WriteDHT(const std::array<std::array<HuffmanSpec, 2>, 2>& specs,
+              const TableFrequencies& frequencies, std::vector<uint8_t>* output) {
+    std::vector<uint8_t> payload;
+    for (size_t type = 0; type < 2; ++type) {
+        for (size_t id = 0; id < 2; ++id) {
+            if (!IsUsed(frequencies[type][id])) {
+                continue;
+            }
+            payload.push_back(type << 4 | id);
+            payload.insert(payload.end(), specs[type][id].bits.begin(), specs[type][id].bits.end());
+            payload.insert(payload.end(), specs[type][id].values.begin(), specs[type][id].values.end());
+        }
+    }
+    output->insert(output->end(), {0xFF, 0xC4, static_cast<uint8_t>((payload.size() + 2) >> 8),
+                                   static_cast<uint8_t>(payload.size() + 2)});
+    output->insert(output->end(), payload.begin(), payload.end());
+}
+
+struct ProgressiveScan {
+    std::vector<size_t> components;
+    size_t Ss;
+    size_t Se;
+    size_t Ah;
+    size_t Al;
+};
+
+/* The script of libjpeg's jpeg_simple_progression */
+std::vector<ProgressiveScan> StandardScanScript(size_t number_of_components) {
+    if (number_of_components == 1) {
+        return {
+                {{0}, 0, 0, 0, 1},
+                {{0}, 1, 5, 0, 2},
+                {{0}, 6, 63, 0, 2},
+                {{0}, 1, 63, 2, 1},
+                {{0}, 0, 0, 1, 0},
+                {{0}, 1, 63, 1, 0}
+        };
+    }
+    return {
+            {{0, 1, 2}, 0, 0, 0, 1},
+            {{0}, 1, 5, 0, 2},
+            {{2}, 1, 63, 0, 1},
+            {{1}, 1, 63, 0, 1},
+            {{0}, 6, 63, 0, 2},
+            {{0}, 1, 63, 2, 1},
+            {{0, 1, 2}, 0, 0, 1, 0},
+            {{2}, 1, 63, 1, 0},
+            {{1}, 1, 63, 1, 0},
+            {{0}, 1, 63, 1, 0}
+    };
+}
+
+/* Luminance uses tables 0, chrominance DC uses table 1. AC scans hold one component */
+size_t GetProgressiveTableId(const ProgressiveScan& scan, size_t component) {
+    return scan.Ss == 0 && component != 0;
+}
+
+/* Counts the symbols of a scan and keeps them in order along with their extra bits, so the
+ * blocks are walked once and the scan is written with tables built from its own counts. One
+ * sink serves every scan of a file, keeping its buffer. */
+class RecordingSink {
+public:
+    void Clear() {
+        frequencies_ = {};
+        codes_.clear();
+    }
+
+    const TableFrequencies& Frequencies() const {
+        return frequencies_;
+    }
+
+    void Symbol(TableType type, size_t table_id, uint8_t symbol) {
+        ++frequencies_[type][table_id][symbol];
+        codes_.push_back({0, 0, symbol, static_cast<int8_t>(type * 2 + table_id)});
+    }
+
+    /* The extra bits of a symbol share its code */
+    void Bits(uint32_t bits, size_t size) {
+        if (!size) {
+            return;
+        }
+        if (!codes_.empty() && !codes_.back().size) {
+            codes_.back().bits = bits;
+            codes_.back().size = size;
+        } else {
+            codes_.push_back({bits, static_cast<uint8_t>(size), 0, -1});
+        }
+    }
+
+    void Replay(const std::array<std::array<HuffmanEncoder, 2>, 2>& encoders,
+                BitWriter* writer) const {
+        for (auto&& code : codes_) {
+            if (code.table >= 0) {
+                encoders[code.table / 2][code.table % 2].Encode(writer, code.symbol);
+            }
+            writer->PutBits(code.bits, code.size);
+        }
+    }
+
+private:
+    /* A symbol of a table followed by size bits, table is -1 for bits alone */
+    struct Code {
+        uint32_t bits;
+        uint8_t size;
+        uint8_t symbol;
+        int8_t table;
+    };
+
+    TableFrequencies frequencies_{};
+    std::vector<Code> codes_;
+};
+
+/* Annex G.1.2 entropy coding of one progressive scan, see also libjpeg's jcphuff.c */
+template <typename Sink>
+class ProgressiveScanEncoder {
+public:
+    ProgressiveScanEncoder(const ProgressiveScan& scan, size_t number_of_components, Sink* sink)
+            : scan_(scan), sink_(sink), last_DC_(number_of_components) {}
+
+    void EncodeBlock(const Decoder::Block& block, size_t component) {
+        if (scan_.Ss == 0) {
+            if (scan_.Ah == 0) {
+                EncodeDCFirst(block, component);
+            } else {
+                sink_->Bits((block[0][0] >> scan_.Al) & 1, 1);
+            }
+        } else if (scan_.Ah == 0) {
+            EncodeACFirst(block);
+        } else {
+            EncodeACRefine(block);
+        }
+    }
+
+    void Finish() {
+        EmitEOBRun();
+    }
+
+private:
+    static constexpr size_t kMaxEOBRun = 0x7FFF;
+    static constexpr size_t kMaxCorrectionBits = 1000;
+
+    const ProgressiveScan& scan_;
+    Sink* sink_;
+
+    std::vector<int> last_DC_;
+    size_t EOB_run_ = 0;
+    std::vector<uint8_t> EOB_run_correction_bits_;
+    std::vector<uint8_t> correction_bits_;
+
+    int GetCoef(const Decoder::Block& block, size_t k) const {
+        return block[kZigzagOrder[k] / BLOCK_SIZE][kZigzagOrder[k] % BLOCK_SIZE];
+    }
+
+    /* Sixteen bits to a call */
+    void EmitCorrectionBits(std::vector<uint8_t>* bits) {
+        uint32_t chunk = 0;
+        size_t size = 0;
+        for (auto bit : *bits) {
+            chunk = chunk << 1 | bit;
+            if (++size == 16) {
+                sink_->Bits(chunk, size);
+                chunk = 0;
+                size = 0;
+            }
+        }
+        sink_->Bits(chunk, size);
+        bits->clear();
+    }
+
+    void EmitEOBRun() {
+        if (!EOB_run_) {
+            return;
+        }
+        auto size = GetCoefSize(EOB_run_) - 1;
+        sink_->Symbol(AC, 0, size << 4);
+        sink_->Bits(EOB_run_, size);
+        EOB_run_ = 0;
+        EmitCorrectionBits(&EOB_run_correction_bits_);
+    }
+
+    void EncodeDCFirst(const Decoder::Block& block, size_t component) {
+        int coef = block[0][0] >> scan_.Al;
+        int diff = coef - last_DC_[component];
+        last_DC_[component] = coef;
+        auto size = GetCoefSize(diff);
+        ASSERT(size <= 11, "DC coefficient is out of range");
+        sink_->Symbol(DC, GetProgressiveTableId(scan_, component), size);
+        sink_->Bits(GetCoefBits(diff, size), size);
+    }
+
+    void EncodeACFirst(const Decoder::Block& block) {
+        size_t run = 0;
+        for (size_t k = scan_.Ss; k <= scan_.Se; ++k) {
+            int coef = GetCoef(block, k);
+            int abs = (coef < 0 ? -coef : coef) >> scan_.Al;
+            if (!abs) {
+                ++run;
+                continue;
+            }
+            EmitEOBRun();
+            while (run >= 16) {
+                sink_->Symbol(AC, 0, 0xF0);
+                run -= 16;
+            }
+            auto size = GetCoefSize(abs);
+            ASSERT(size <= 10, "AC coefficient is out of range");
+            sink_->Symbol(AC, 0, (run << 4) | size);
+            sink_->Bits(GetCoefBits(coef < 0 ? -abs : abs, size), size);
+            run = 0;
+        }
+        if (run) {
+            if (++EOB_run_ == kMaxEOBRun) {
+                EmitEOBRun();
+            }
+        }
+    }
+
+    void EncodeACRefine(const Decoder::Block& block) {
+        std::array<int, 64> abs;
+        size_t last_new = 0;
+        for (size_t k = scan_.Ss; k <= scan_.Se; ++k) {
+            int coef = GetCoef(block, k);
+            abs[k] = (coef < 0 ? -coef : coef) >> scan_.Al;
+            if (abs[k] == 1) {
+                last_new = k;
+            }
+        }
+
+        size_t run = 0;
+        for (size_t k = scan_.Ss; k <= scan_.Se; ++k) {
+            if (!abs[k]) {
+                ++run;
+                continue;
+            }
+            /* ZRLs past the last newly nonzero coefficient are folded into EOB */
+            while (run >= 16 && k <= last_new) {
+                EmitEOBRun();
+                sink_->Symbol(AC, 0, 0xF0);
+                run -= 16;
+                EmitCorrectionBits(&correction_bits_);
+            }
+            if (abs[k] > 1) {
+                correction_bits_.push_back(abs[k] & 1);
+                continue;
+            }
+            EmitEOBRun();
+            sink_->Symbol(AC, 0, (run << 4) | 1);
+            sink_->Bits(GetCoef(block, k) > 0, 1);
+            EmitCorrectionBits(&correction_bits_);
+            run = 0;
+        }
+
+        if (run || !correction_bits_.empty()) {
+            ++EOB_run_;
+            EOB_run_correction_bits_.insert(EOB_run_correction_bits_.end(),
+                                            correction_bits_.begin(), correction_bits_.end());
+            correction_bits_.clear();
+            if (EOB_run_ == kMaxEOBRun || EOB_run_correction_bits_.size() > kMaxCorrectionBits) {
+                EmitEOBRun();
+            }
+        }
+    }
+};
+
+template <typename Sink>
+void RunProgressiveScan(const Decoder& decoder, const ProgressiveScan& progressive_scan, Sink* sink) {
+    const auto& components = decoder.GetComponents();
+    Decoder::Scan scan;
+    for (auto component : progressive_scan.components) {
+        scan.components.push_back({component, 0, 0});
+    }
+    decoder.ComputeScanSize(&scan);
+
+    ProgressiveScanEncoder<Sink> encoder(progressive_scan, components.size(), sink);
+    for (size_t mcu_y = 0; mcu_y < scan.mcus_v; ++mcu_y) {
+        for (size_t mcu_x = 0; mcu_x < scan.mcus_h; ++mcu_x) {
+            decoder.ForEachBlockOfMCU(scan, mcu_y, mcu_x, [&](size_t component, size_t block) {
+                encoder.EncodeBlock(components[component].blocks[block], component);
+            });
+        }
+    }
+    encoder.Finish();
+}
+
+void WriteProgressiveSOS(const Decoder& decoder, const ProgressiveScan& scan,
+                         std::vector<uint8_t>* output) {
+    size_t len = 6 + 2 * scan.components.size();
+    output->insert(output->end(), {0xFF, 0xDA, static_cast<uint8_t>(len >> 8),
+                                   static_cast<uint8_t>(len),
+                                   static_cast<uint8_t>(scan.components.size())});
+    for (auto component : scan.components) {
+        auto table_id = GetProgressiveTableId(scan, component);
+        output->push_back(decoder.GetComponents()[component].id);
+        output->push_back(scan.Ss == 0 ? table_id << 4 : table_id);
+    }
+    output->insert(output->end(), {static_cast<uint8_t>(scan.Ss), static_cast<uint8_t>(scan.Se),
+                                   static_cast<uint8_t>(scan.Ah << 4 | scan.Al)});
+}
+
+void WriteProgressiveScans(const Decoder& decoder, std::vector<uint8_t>* output) {
+    RecordingSink recording;
+    for (auto&& scan : StandardScanScript(decoder.GetComponents().size())) {
+        recording.Clear();
+        RunProgressiveScan(decoder, scan, &recording);
+        auto& frequencies = recording.Frequencies();
+
+        std::array<std::array<HuffmanSpec, 2>, 2> specs;
+        std::array<std::array<HuffmanEncoder, 2>, 2> encoders;
+        bool has_tables = false;
+        for (size_t type = 0; type < 2; ++type) {
+            for (size_t id = 0; id < 2; ++id) {
+                if (IsUsed(frequencies[type][id])) {
+                    specs[type][id] = BuildOptimalHuffmanSpec(frequencies[type][id]);
+                    encoders[type][id] = HuffmanEncoder(specs[type][id]);
+                    has_tables = true;
+                }
+            }
+        }
+        if (has_tables) {
+            WriteDHT(specs, frequencies, output);
+        }
+
+        WriteProgressiveSOS(decoder, scan, output);
+        BitWriter writer(output);
+        recording.Replay(encoders, &writer);
+        writer.Flush();
+    }
+}
+
+}  // namespace
+
+HuffmanSpec BuildOptimalHuffmanSpec(const SymbolFrequencies& frequencies) {
+    /* Symbol 256 is reserved so that no real symbol gets the all-ones code */
+    constexpr size_t kSymbols = 257;
+    std::array<uint64_t, kSymbols> freq;
+    std::copy(frequencies.begin(), frequencies.end(), freq.begin());
+    freq[256] = 1;
+
+    std::array<int, kSymbols> others;
+    others.fill(-1);
+    std::array<size_t, kSymbols> code_size{};
+
+    while (true) {
+        int c1 = -1;
+        int c2 = -1;
+        auto v1 = std::numeric_limits<uint64_t>::max();
+        auto v2 = std::numeric_limits<uint64_t>::max();
+        for (size_t i = 0; i < kSymbols; ++i) {
+            if (freq[i] && freq[i] <= v1) {
+                v1 = freq[i];
+                c1 = i;
+            }
+        }
+        for (size_t i = 0; i < kSymbols; ++i) {
+            if (freq[i] && freq[i] <= v2 && static_cast<int>(i) != c1) {
+                v2 = freq[i];
+                c2 = i;
+            }
+        }
+        if (c2 < 0) {
+            break;
+        }
+
+        freq[c1] += freq[c2];
+        freq[c2] = 0;
+
+        ++code_size[c1];
+        while (others[c1] >= 0) {
+            c1 = others[c1];
+            ++code_size[c1];
+        }
+        others[c1] = c2;
+
+        ++code_size[c2];
+        while (others[c2] >= 0) {
+            c2 = others[c2];
+            ++code_size[c2];
+        }
+    }
+
+    std::array<size_t, kSymbols + 1> bits{};
+    for (size_t i = 0; i < kSymbols; ++i) {
+        if (code_size[i]) {
+            ++bits[code_size[i]];
+        }
+    }
+
+    /* Move the deepest pair of leaves up and a shallower leaf down until everything fits */
+    for (size_t i = kSymbols; i > 16; --i) {
+        while (bits[i] > 0) {
+            size_t j = i - 2;
+            while (bits[j] == 0) {
+                --j;
+            }
+            bits[i] -= 2;
+            ++bits[i - 1];
+            bits[j + 1] += 2;
+            --bits[j];
+        }
+    }
+
+    size_t longest = 16;
+    while (bits[longest] == 0) {
+        --longest;
+    }
+    --bits[longest];
+
+    HuffmanSpec spec;
+    for (size_t len = 1; len <= 16; ++len) {
+        spec.bits[len - 1] = bits[len];
+    }
+    for (size_t len = 1; len <= kSymbols; ++len) {
+        for (size_t symbol = 0; symbol < 256; ++symbol) {
+            if (code_size[symbol] == len) {
+                spec.values.push_back(symbol);
+            }
+        }
+    }
+    return spec;
+}
+
+void OptimizeHuffman(const std::string& input, const std::string& output, size_t threads) {
+    auto data = ReadFileBytes(input);
+    Decoder decoder(File(data.data(), data.size()));
+    decoder.KeepCoefficients();
+    decoder.Parse();
+
+    TableFrequencies frequencies{};
+    for (auto&& scan : decoder.GetScans()) {
+        GatherStatistics(decoder, scan, threads, &frequencies);
+    }
+
+    std::array<std::array<HuffmanSpec, 2>, 2> specs;
+    std::array<std::array<HuffmanEncoder, 2>, 2> encoders;
+    for (size_t type = 0; type < 2; ++type) {
+        for (size_t id = 0; id < 2; ++id) {
+            if (IsUsed(frequencies[type][id])) {
+                specs[type][id] = BuildOptimalHuffmanSpec(frequencies[type][id]);
+                encoders[type][id] = HuffmanEncoder(specs[type][id]);
+            }
+        }
+    }
+
+    std::vector<uint8_t> result;
+    result.reserve(data.size());
+    size_t scan_index = 0;
+    for (auto&& segment : SplitSegments(data)) {
+        if (segment.marker == 0xC4) {
+            continue;
+        }
+        if (segment.marker == 0xDA && !scan_index) {
+            WriteDHT(specs, frequencies, &result);
+        }
+        result.insert(result.end(), data.begin() + segment.begin, data.begin() + segment.end);
+        if (segment.marker == 0xDA) {
+            EncodeScan(decoder, decoder.GetScans().at(scan_index++), encoders, &result);
+        }
+    }
+
+    WriteFileBytes(output, result);
+}
+
+void TranscodeToProgressive(const std::string& input, const std::string& output) {
+    auto data = ReadFileBytes(input);
+    Decoder decoder(File(data.data(), data.size()));
+    decoder.KeepCoefficients();
+    decoder.Parse();
+
+    std::vector<uint8_t> result;
+    result.reserve(data.size());
+    bool scans_written = false;
+    for (auto&& segment : SplitSegments(data)) {
+        /* Progressive scans carry their own tables and no restart markers */
+        if (segment.marker == 0xC4 || segment.marker == 0xDD) {
+            continue;
+        }
+        if (segment.marker == 0xDA) {
+            if (!scans_written) {
+                WriteProgressiveScans(decoder, &result);
+                scans_written = true;
+            }
+            continue;
+        }
+        auto begin = result.size();
+        result.insert(result.end(), data.begin() + segment.begin, data.begin() + segment.end);
+        if (segment.marker == 0xC0) {
+            result[begin + 1] = 0xC2;
+        }
+    }
+
+    WriteFileBytes(output, result);
+}
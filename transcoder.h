@@ -0,0 +1,137 @@
+#pragma once
+
+#include "decoder.h"
+
+#include <array>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+using SymbolFrequencies = std::array<uint64_t, 256>;
+
+/* BITS and HUFFVAL lists as they are stored in DHT */
+struct HuffmanSpec {
+    std::array<uint8_t, 16> bits{};
+    std::vector<uint8_t> values;
+};
+
+class BitWriter {
+public:
+    explicit BitWriter(std::vector<uint8_t>* output) : output_(output) {}
+
+    void PutBits(uint32_t bits, size_t size) {
+        buffer_ = (buffer_ << size) | (bits & ((1u << size) - 1));
+        buffer_size_ += size;
+        while (buffer_size_ >= 8) {
+            uint8_t byte = buffer_ >> (buffer_size_ - 8);
+            output_->push_back(byte);
+            if (byte == 0xFF) {
+                output_->push_back(0x00);
+            }
+            buffer_size_ -= 8;
+        }
+        buffer_ &= (1u << buffer_size_) - 1;
+    }
+
+    /* Pads the last byte with ones */
+    void Flush() {
+        if (buffer_size_) {
+            PutBits(0x7F, 8 - buffer_size_);
+        }
+    }
+
+    void PutMarker(uint8_t marker) {
+        Flush();
+        output_->push_back(0xFF);
+        output_->push_back(marker);
+    }
+
+private:
+    std::vector<uint8_t>* output_;
+
+    uint32_t buffer_ = 0;
+    size_t buffer_size_ = 0;
+};
+
+class HuffmanEncoder {
+public:
+    HuffmanEncoder() = default;
+
+    explicit HuffmanEncoder(const HuffmanSpec& spec) {
+        uint32_t code = 0;
+        size_t k = 0;
+        for (size_t len = 1; len <= spec.bits.size(); ++len) {
+            for (size_t i = 0; i < spec.bits[len - 1]; ++i) {
+                auto symbol = spec.values.at(k++);
+                codes_[symbol] = code++;
+                sizes_[symbol] = len;
+            }
+            code <<= 1;
+        }
+    }
+
+    void Encode(BitWriter* writer, uint8_t symbol) const {
+        if (!sizes_[symbol]) {
+            throw std::runtime_error("Symbol has no Huffman code");
+        }
+        writer->PutBits(codes_[symbol], sizes_[symbol]);
+    }
+
+private:
+    std::array<uint16_t, 256> codes_{};
+    std::array<uint8_t, 256> sizes_{};
+};
+
+inline size_t GetCoefSize(int coef) {
+    unsigned abs = coef < 0 ? -coef : coef;
+    return abs ? 32 - __builtin_clz(abs) : 0;
+}
+
+/* Inverse of Decoder::GetCoef: negative values are stored as coef - 1 in size bits */
+inline uint32_t GetCoefBits(int coef, size_t size) {
+    if (coef < 0) {
+        coef -= 1;
+    }
+    return static_cast<uint32_t>(coef) & ((1u << size) - 1);
+}
+
+/* Feeds the Huffman symbols of a sequential block to sink(symbol, bits, size) */
+template <typename DCSink, typename ACSink>
+void EmitBlock(const Decoder::Block& block, int last_DC, DCSink&& DC_sink, ACSink&& AC_sink) {
+    int diff = block[0][0] - last_DC;
+    auto size = GetCoefSize(diff);
+    ASSERT(size <= 11, "DC coefficient is out of range");
+    DC_sink(size, GetCoefBits(diff, size), size);
+
+    size_t run = 0;
+    for (size_t k = 1; k < kZigzagOrder.size(); ++k) {
+        int coef = block[kZigzagOrder[k] / BLOCK_SIZE][kZigzagOrder[k] % BLOCK_SIZE];
+        if (!coef) {
+            ++run;
+            continue;
+        }
+        while (run >= 16) {
+            AC_sink(0xF0, 0, 0);
+            run -= 16;
+        }
+        size = GetCoefSize(coef);
+        ASSERT(size <= 10, "AC coefficient is out of range");
+        AC_sink((run << 4) | size, GetCoefBits(coef, size), size);
+        run = 0;
+    }
+    if (run) {
+        AC_sink(0x00, 0, 0);
+    }
+}
+
+/* Annex K.2: code lengths limited to 16 bits, the all-ones code is never assigned */
+HuffmanSpec BuildOptimalHuffmanSpec(const SymbolFrequencies& frequencies);
+
+/* Rewrites a baseline JPEG with Huffman tables built from its own coefficient statistics.
+ * Coefficients are kept as is, so the result decodes to exactly the same image.
+ * Statistics are gathered by threads MCU rows at a time, 0 means hardware concurrency. */
+void OptimizeHuffman(const std::string& input, const std::string& output, size_t threads = 0);
+
+/* Rewrites a baseline JPEG as a progressive (SOF2) one with the standard libjpeg scan script
+ * and per-scan optimal Huffman tables. Coefficients are kept as is. */
+void TranscodeToProgressive(const std::string& input, const std::string& output);